@@ -0,0 +1,187 @@
+#pragma once
+
+#include <cctype>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "matetb.hpp"
+#include "options.hpp"
+
+// one line of an --epdFile, and its result
+struct puzzle_t {
+  std::size_t line;
+  std::string epd_line, epd; // epd is the part of epd_line before ';'
+  std::string result;        // empty until the puzzle is solved or skipped
+  score_t score = VALUE_NONE;
+  std::string pv;
+  std::size_t positions = 0, threads = 0;
+  double seconds = 0;
+
+  bool done() const { return !result.empty(); }
+};
+
+// the lines of an --epdFile, like check.sh reads them: only the lines that
+// need an engine are skipped
+inline std::vector<puzzle_t> read_puzzles(const std::string &filename) {
+  std::ifstream f(filename);
+  if (!f) {
+    std::cout << "Cannot open EPD file " << filename << "." << std::endl;
+    std::exit(1);
+  }
+  std::vector<puzzle_t> puzzles;
+  std::size_t line = 0;
+  for (std::string epd_line; std::getline(f, epd_line);) {
+    ++line;
+    if (split(epd_line.substr(0, epd_line.find(';'))).size() < 4)
+      continue;
+    puzzle_t puzzle;
+    puzzle.line = line;
+    puzzle.epd_line = epd_line;
+    puzzle.epd = epd_line.substr(0, epd_line.find(';'));
+    if (epd_line.find("needs engine") != std::string::npos)
+      puzzle.result = "skipped";
+    puzzles.push_back(std::move(puzzle));
+  }
+  return puzzles;
+}
+
+// the options of the batch for one of its puzzles, with the known excludes
+inline Options puzzle_options(const Options &options, const puzzle_t &puzzle) {
+  Options puzzle_options = options;
+  puzzle_options.epdStr = puzzle.epd;
+  puzzle_options.fill_exclude_options();
+  return puzzle_options;
+}
+
+// Solves puzzle with mtb, which has been set up for its options. The mate
+// found matches if the EPD is "<root_pos> bm #<mate>", as in check.sh.
+// Returns false if the game tree exceeds the limit of mtb.
+template <typename TB> bool solve_puzzle(TB &mtb, puzzle_t &puzzle) {
+  auto tic = std::chrono::high_resolution_clock::now();
+  if (!mtb.create_tb())
+    return false;
+  std::tie(puzzle.score, puzzle.pv) = mtb.output();
+  auto toc = std::chrono::high_resolution_clock::now();
+  puzzle.seconds =
+      std::chrono::duration_cast<std::chrono::milliseconds>(toc - tic).count() /
+      1000.0;
+  puzzle.positions = mtb.size();
+  auto parts = split(puzzle.epd);
+  std::string found;
+  if (puzzle.score != VALUE_NONE && puzzle.score != 0)
+    found = join(parts.begin(), parts.begin() + 4) + " bm #" +
+            std::to_string(score2mate(puzzle.score));
+  if (found == puzzle.epd)
+    puzzle.result = "match";
+  else if (puzzle.epd_line.find("finds") != std::string::npos &&
+           found.substr(0, found.find('#')) ==
+               puzzle.epd.substr(0, puzzle.epd.find('#')))
+    puzzle.result = "expected partial match";
+  else
+    puzzle.result = "no match";
+  return true;
+}
+
+// The output of a batch. While it exists, everything written to std::cout is
+// discarded (the TBs of the puzzles write to it unless they are given streams
+// of their own), and only the results of the puzzles are printed.
+class BatchOutput {
+  // discards all the characters
+  class null_buffer : public std::streambuf {
+  protected:
+    int overflow(int c) override { return traits_type::not_eof(c); }
+  };
+
+  null_buffer null_buffer_;
+  std::streambuf *cout_buffer_;
+  std::ostream out_;
+  std::mutex mutex_;
+  std::chrono::high_resolution_clock::time_point tic_;
+
+public:
+  BatchOutput()
+      : cout_buffer_(std::cout.rdbuf(&null_buffer_)), out_(cout_buffer_),
+        tic_(std::chrono::high_resolution_clock::now()) {}
+  ~BatchOutput() { std::cout.rdbuf(cout_buffer_); }
+
+  void print(const std::string &message) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    out_ << message << std::endl;
+  }
+
+  void print(const puzzle_t &puzzle) {
+    std::ostringstream ss;
+    ss << "Line " << puzzle.line << ": " << puzzle.epd_line << "\n  ";
+    for (char c : puzzle.result)
+      ss << char(std::toupper(c));
+    if (puzzle.result != "skipped") {
+      ss << ": ";
+      if (puzzle.score != VALUE_NONE && puzzle.score != 0)
+        ss << "bm #" << score2mate(puzzle.score) << "; PV: " << puzzle.pv;
+      else
+        ss << "no mate found";
+      ss << " (" << puzzle.positions << " positions, " << std::fixed
+         << std::setprecision(2) << puzzle.seconds << "s, " << puzzle.threads
+         << (puzzle.threads == 1 ? " thread)" : " threads)");
+    }
+    print(ss.str());
+  }
+
+  // writes the results to filename (if given) and prints a summary, returns
+  // true if all the puzzles that were not skipped match
+  bool finish(const std::vector<puzzle_t> &puzzles,
+              const std::string &filename) {
+    if (!filename.empty()) {
+      std::ofstream f(filename);
+      for (const auto &puzzle : puzzles) {
+        f << "{\"line\": " << puzzle.line
+          << ", \"epd\": " << json_string(puzzle.epd)
+          << ", \"result\": " << json_string(puzzle.result);
+        if (puzzle.result != "skipped") {
+          f << ", \"mate\": ";
+          if (puzzle.score != VALUE_NONE && puzzle.score != 0)
+            f << score2mate(puzzle.score);
+          else
+            f << "null";
+          f << ", \"pv\": " << json_string(puzzle.pv)
+            << ", \"positions\": " << puzzle.positions
+            << ", \"threads\": " << puzzle.threads
+            << ", \"seconds\": " << std::fixed << std::setprecision(3)
+            << puzzle.seconds;
+        }
+        f << "}\n";
+      }
+      if (!f) {
+        print("Error writing results file " + filename + ".");
+        std::exit(1);
+      }
+      print("Wrote the results to " + filename + ".");
+    }
+    std::size_t matches = 0, partial = 0, skipped = 0;
+    for (const auto &puzzle : puzzles) {
+      matches += puzzle.result == "match";
+      partial += puzzle.result == "expected partial match";
+      skipped += puzzle.result == "skipped";
+    }
+    auto toc = std::chrono::high_resolution_clock::now();
+    double duration =
+        std::chrono::duration_cast<std::chrono::milliseconds>(toc - tic_)
+            .count() /
+        1000.0;
+    std::ostringstream ss;
+    ss << "Solved " << puzzles.size() - skipped << " puzzles in " << std::fixed
+       << std::setprecision(2) << duration << "s: " << matches
+       << " matches, " << partial << " expected partial matches, "
+       << puzzles.size() - skipped - matches - partial << " no matches, "
+       << skipped << " skipped.";
+    print(ss.str());
+    return matches + partial + skipped == puzzles.size();
+  }
+};
@@ -0,0 +1,98 @@
+// Benchmark of the expansion of a node into the PackedBoards of its children:
+// ChildEncoder against makeMove<true>(), Board::Compact::encode() and
+// unmakeMove(). The nodes are random walks from the EPDs in the file, and both
+// methods have to give the same children.
+//
+// Usage: ./bench_encode [EPD file] [nodes]
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "external/chess.hpp"
+#include "matetb.hpp"
+
+template <typename F> double time_it(F &&f) {
+  auto tic = std::chrono::high_resolution_clock::now();
+  f();
+  auto toc = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double>(toc - tic).count();
+}
+
+int main(int argc, char **argv) {
+  std::string filename = argc > 1 ? argv[1] : "matetb.epd";
+  size_t n = argc > 2 ? std::stoull(argv[2]) : 200000;
+  std::vector<std::string> epds;
+  std::ifstream f(filename);
+  for (std::string line; std::getline(f, line);) {
+    auto parts = split(line.substr(0, line.find(';')));
+    if (parts.size() >= 4)
+      epds.push_back(join(parts.begin(), parts.begin() + 4));
+  }
+  if (epds.empty()) {
+    std::cout << "No EPDs found in " << filename << "." << std::endl;
+    return 1;
+  }
+  std::mt19937_64 rng(42);
+  std::vector<PackedBoard> nodes;
+  while (nodes.size() < n)
+    for (const auto &epd : epds) {
+      Board board(epd);
+      for (int ply = 0; ply < 20 && nodes.size() < n; ++ply) {
+        Movelist legal_moves;
+        movegen::legalmoves(legal_moves, board);
+        if (legal_moves.empty())
+          break;
+        nodes.push_back(Board::Compact::encode(board));
+        board.makeMove<true>(legal_moves[rng() % legal_moves.size()]);
+      }
+    }
+  std::cout << "Expanding " << nodes.size() << " nodes from random walks."
+            << std::endl;
+  std::vector<PackedBoard> expected, got;
+  size_t children = 0;
+  double t_board = time_it([&]() {
+    for (const auto &pfen : nodes) {
+      auto board = Board::Compact::decode(pfen);
+      Movelist legal_moves;
+      movegen::legalmoves(legal_moves, board);
+      for (const Move &move : legal_moves) {
+        board.makeMove<true>(move);
+        expected.push_back(Board::Compact::encode(board));
+        board.unmakeMove(move);
+      }
+    }
+  });
+  double t_encoder = time_it([&]() {
+    for (const auto &pfen : nodes) {
+      auto board = Board::Compact::decode(pfen);
+      Movelist legal_moves;
+      movegen::legalmoves(legal_moves, board);
+      ChildEncoder encode_child(board, pfen);
+      for (const Move &move : legal_moves)
+        got.push_back(encode_child(move));
+    }
+  });
+  children = expected.size();
+  std::cout << std::fixed << std::setprecision(2);
+  std::cout << "makeMove + encode: " << std::setw(7)
+            << children / t_board / 1e6 << " Mchildren/s" << std::endl;
+  std::cout << "ChildEncoder     : " << std::setw(7)
+            << children / t_encoder / 1e6 << " Mchildren/s ("
+            << t_board / t_encoder << "x)" << std::endl;
+  if (got != expected) {
+    for (size_t i = 0; i < std::min(got.size(), children); ++i)
+      if (got[i] != expected[i]) {
+        std::cout << "Error: child " << i << " is "
+                  << Board::Compact::decode(got[i]).getFen() << " instead of "
+                  << Board::Compact::decode(expected[i]).getFen() << std::endl;
+        break;
+      }
+    return 1;
+  }
+  return 0;
+}
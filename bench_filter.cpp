@@ -0,0 +1,105 @@
+// Benchmark of the reply checks of allowed_move(): has_legal_capture() against
+// generating all the legal replies, for --excludeToCapturable and
+// --excludeAllowingCapture. The positions are random walks from the EPDs in
+// the file, and the results of both methods have to agree.
+//
+// Usage: ./bench_filter [EPD file] [positions]
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "external/chess.hpp"
+#include "matetb.hpp"
+
+template <typename F> double time_it(F &&f) {
+  auto tic = std::chrono::high_resolution_clock::now();
+  f();
+  auto toc = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double>(toc - tic).count();
+}
+
+// the previous implementation: generate all the legal replies
+std::pair<bool, bool> captures_by_movegen(Board &board, const Move &move) {
+  bool to_capturable = false, allowing_capture = false;
+  board.makeMove(move);
+  Movelist legal_moves;
+  movegen::legalmoves(legal_moves, board);
+  for (const Move &m : legal_moves)
+    if (board.isCapture(m)) {
+      allowing_capture = true;
+      to_capturable |= m.to() == move.to();
+    }
+  board.unmakeMove(move);
+  return {to_capturable, allowing_capture};
+}
+
+std::pair<bool, bool> captures_by_attacks(Board &board, const Move &move) {
+  board.makeMove(move);
+  bool to_capturable =
+      has_legal_capture(board, Bitboard::fromSquare(move.to()), false);
+  bool allowing_capture = has_legal_capture(board, Bitboard(~0ull), true);
+  board.unmakeMove(move);
+  return {to_capturable, allowing_capture};
+}
+
+int main(int argc, char **argv) {
+  std::string filename = argc > 1 ? argv[1] : "matetb.epd";
+  size_t n = argc > 2 ? std::stoull(argv[2]) : 200000;
+  std::vector<std::string> epds;
+  std::ifstream f(filename);
+  for (std::string line; std::getline(f, line);) {
+    auto parts = split(line.substr(0, line.find(';')));
+    if (parts.size() >= 4)
+      epds.push_back(join(parts.begin(), parts.begin() + 4));
+  }
+  if (epds.empty()) {
+    std::cout << "No EPDs found in " << filename << "." << std::endl;
+    return 1;
+  }
+  std::mt19937_64 rng(42);
+  std::vector<std::pair<Board, Move>> samples;
+  while (samples.size() < n)
+    for (const auto &epd : epds) {
+      Board board(epd);
+      for (int ply = 0; ply < 20 && samples.size() < n; ++ply) {
+        Movelist legal_moves;
+        movegen::legalmoves(legal_moves, board);
+        if (legal_moves.empty())
+          break;
+        Move move = legal_moves[rng() % legal_moves.size()];
+        samples.push_back({board, move});
+        board.makeMove<true>(move);
+      }
+    }
+  std::cout << "Checking the replies to " << samples.size()
+            << " moves from random walks." << std::endl;
+  std::vector<std::pair<bool, bool>> expected(samples.size()),
+      got(samples.size());
+  double t_movegen = time_it([&]() {
+    for (size_t i = 0; i < samples.size(); ++i)
+      expected[i] = captures_by_movegen(samples[i].first, samples[i].second);
+  });
+  double t_attacks = time_it([&]() {
+    for (size_t i = 0; i < samples.size(); ++i)
+      got[i] = captures_by_attacks(samples[i].first, samples[i].second);
+  });
+  std::cout << std::fixed << std::setprecision(2);
+  std::cout << "legal move generation: " << std::setw(7)
+            << samples.size() / t_movegen / 1e6 << " Mmoves/s" << std::endl;
+  std::cout << "has_legal_capture    : " << std::setw(7)
+            << samples.size() / t_attacks / 1e6 << " Mmoves/s ("
+            << t_movegen / t_attacks << "x)" << std::endl;
+  for (size_t i = 0; i < samples.size(); ++i)
+    if (expected[i] != got[i]) {
+      std::cout << "Error: mismatch for "
+                << uci::moveToUci(samples[i].second) << " in "
+                << samples[i].first.getFen() << std::endl;
+      return 1;
+    }
+  return 0;
+}
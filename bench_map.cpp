@@ -0,0 +1,122 @@
+// Benchmark of the concurrent PackedBoard -> index maps: the lock-free
+// ConcurrentIndexMap against the phmap::parallel_flat_hash_map configuration
+// that was previously used in matetb_threaded.cpp.
+//
+// Usage: ./bench_map [keys] [duplicates per key] [max threads]
+
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "concurrent_map.hpp"
+#include "external/chess.hpp"
+#include "external/parallel_hashmap/phmap.h"
+#include "external/threadpool.hpp"
+#include "matetb.hpp"
+
+using phmap_t = phmap::parallel_flat_hash_map<
+    PackedBoard, index_t, PackedBoardHash, std::equal_to<PackedBoard>,
+    std::allocator<std::pair<PackedBoard, index_t>>, 8, std::mutex>;
+using cmap_t = ConcurrentIndexMap<PackedBoard, PackedBoardHash>;
+
+template <typename F> double time_it(F &&f) {
+  auto tic = std::chrono::high_resolution_clock::now();
+  f();
+  auto toc = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double>(toc - tic).count();
+}
+
+int main(int argc, char **argv) {
+  size_t n = argc > 1 ? std::stoull(argv[1]) : 4000000;
+  size_t dups = argc > 2 ? std::stoull(argv[2]) : 3;
+  int max_threads = argc > 3 ? std::stoi(argv[3])
+                             : int(std::thread::hardware_concurrency());
+  // each key appears dups times, in random order, like the transpositions in
+  // the levels of the BFS
+  std::mt19937_64 rng(42);
+  std::vector<PackedBoard> keys(n);
+  for (auto &key : keys)
+    for (size_t i = 0; i < key.size(); i += 8) {
+      std::uint64_t r = rng();
+      for (size_t j = 0; j < 8; ++j)
+        key[i + j] = r >> (8 * j);
+    }
+  std::vector<PackedBoard> stream;
+  stream.reserve(n * dups);
+  for (size_t d = 0; d < dups; ++d)
+    stream.insert(stream.end(), keys.begin(), keys.end());
+  std::shuffle(stream.begin(), stream.end(), rng);
+  std::cout << "Inserting " << stream.size() << " keys (" << n
+            << " unique), then looking up all of them." << std::endl;
+  std::cout << std::fixed << std::setprecision(2);
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    ThreadPool pool(threads);
+    size_t grain = 4096;
+    double t_insert, t_find;
+    {
+      phmap_t map;
+      std::atomic<size_t> count = 0;
+      t_insert = time_it([&]() {
+        pool.parallel_for(stream.size(), grain, [&](size_t begin, size_t end) {
+          for (size_t i = begin; i < end; ++i)
+            map.lazy_emplace_l(
+                stream[i], [](phmap_t::value_type &) {},
+                [&](const phmap_t::constructor &ctor) {
+                  ctor(stream[i], count++);
+                });
+        });
+      });
+      std::atomic<size_t> found = 0;
+      t_find = time_it([&]() {
+        pool.parallel_for(stream.size(), grain, [&](size_t begin, size_t end) {
+          size_t local_found = 0;
+          for (size_t i = begin; i < end; ++i)
+            local_found += map.find(stream[i]) != map.end();
+          found += local_found;
+        });
+      });
+      std::cout << "phmap               threads " << std::setw(3) << threads
+                << ": insert " << std::setw(7)
+                << stream.size() / t_insert / 1e6 << " Mops/s, find "
+                << std::setw(7) << stream.size() / t_find / 1e6 << " Mops/s"
+                << std::endl;
+    }
+    {
+      cmap_t map;
+      std::atomic<size_t> count = 0;
+      t_insert = time_it([&]() {
+        // reserve() is part of the cost
+        map.reserve(n);
+        pool.parallel_for(stream.size(), grain, [&](size_t begin, size_t end) {
+          for (size_t i = begin; i < end; ++i)
+            map.insert(stream[i], [&]() { return index_t(count++); });
+        });
+      });
+      std::atomic<size_t> found = 0;
+      t_find = time_it([&]() {
+        pool.parallel_for(stream.size(), grain, [&](size_t begin, size_t end) {
+          size_t local_found = 0;
+          for (size_t i = begin; i < end; ++i)
+            local_found += map.find_index(stream[i]) != NO_INDEX;
+          found += local_found;
+        });
+      });
+      std::cout << "ConcurrentIndexMap  threads " << std::setw(3) << threads
+                << ": insert " << std::setw(7)
+                << stream.size() / t_insert / 1e6 << " Mops/s, find "
+                << std::setw(7) << stream.size() / t_find / 1e6 << " Mops/s"
+                << std::endl;
+      if (count != n || found != stream.size()) {
+        std::cout << "Error: inserted " << count << ", found " << found
+                  << std::endl;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
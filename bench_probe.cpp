@@ -0,0 +1,111 @@
+// Benchmark of the probe interface of MateTbBase, as an engine would use it: a
+// TB is created for a position from matetb.epd and saved to a TB file, which
+// is then loaded again. The threads do random walks through the positions in
+// the TB, and probe all the children of each position in both TBs, which have
+// to give the same scores. The walks follow best_move() for every fourth move.
+//
+// Usage: ./bench_probe [threads] [probes per thread] [TB file]
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "external/threadpool.hpp"
+#include "matetb_threaded.hpp"
+#include "options.hpp"
+
+const std::string bench_epd = "4R3/1n1p4/3n4/8/8/p4p2/7p/5K1k w - - bm #20;";
+
+int main(int argc, char **argv) {
+  int threads = argc > 1 ? std::stoi(argv[1])
+                         : int(std::thread::hardware_concurrency());
+  std::size_t n = argc > 2 ? std::stoull(argv[2]) : 2000000;
+  std::string filename = argc > 3 ? argv[3] : "bench_probe.tb";
+  Options options;
+  options.epdStr = bench_epd;
+  options.concurrency = std::max(1, threads);
+  options.fill_exclude_options();
+  ThreadPool pool(options.concurrency);
+  // only the results of the benchmark are shown, the TBs write to a stream
+  // without a buffer
+  std::ostream discard(nullptr);
+  MateTB<PackedBoard> mtb(options, pool, discard),
+      loaded(options, pool, discard);
+  mtb.create_tb();
+  mtb.save_tb(filename, "");
+  loaded.load_tb(std::make_unique<TbFile>(filename));
+  std::remove(filename.c_str()); // the mapping stays valid
+  auto parts = split(bench_epd);
+  Board root(join(parts.begin(), parts.begin() + 4));
+  std::cout << bench_epd << std::endl;
+  std::cout << "TB with " << mtb.size() << " positions, root score "
+            << mtb.probe(root) << ", best move "
+            << uci::moveToUci(mtb.best_move(root)) << std::endl;
+  std::atomic<std::size_t> mismatches = 0, found = 0;
+  auto walk = [&](std::size_t thread_id) {
+    std::mt19937_64 rng(thread_id);
+    std::size_t local_mismatches = 0, local_found = 0;
+    Board board = root;
+    for (std::size_t probes = 0; probes < n;) {
+      Movelist legal_moves;
+      movegen::legalmoves(legal_moves, board);
+      std::vector<Move> in_tb;
+      for (const Move &move : legal_moves) {
+        board.makeMove<true>(move);
+        PackedBoard pfen = Board::Compact::encode(board);
+        score_t score = mtb.probe(pfen);
+        local_mismatches += score != loaded.probe(pfen);
+        board.unmakeMove(move);
+        if (score != VALUE_NONE) {
+          local_found++;
+          in_tb.push_back(move);
+        }
+      }
+      probes += legal_moves.size();
+      if (in_tb.empty()) {
+        board = root;
+        continue;
+      }
+      Move move = in_tb[rng() % in_tb.size()];
+      if (rng() % 4 == 0) {
+        move = mtb.best_move(board);
+        local_mismatches += move != loaded.best_move(board);
+      }
+      board.makeMove<true>(move);
+    }
+    mismatches += local_mismatches;
+    found += local_found;
+  };
+  std::cout << "threads  Mprobes/s  found" << std::endl;
+  for (int t = 1;; t = std::min(2 * t, options.concurrency)) {
+    found = 0;
+    auto tic = std::chrono::high_resolution_clock::now();
+    pool.parallel_for(t, 1, [&](std::size_t begin, std::size_t end) {
+      for (std::size_t i = begin; i < end; ++i)
+        walk(i);
+    });
+    auto toc = std::chrono::high_resolution_clock::now();
+    double seconds = std::chrono::duration<double>(toc - tic).count();
+    std::cout << std::setw(7) << t << std::fixed << std::setprecision(2)
+              << std::setw(11) << 2.0 * t * n / seconds / 1e6 << std::setw(6)
+              << std::setprecision(1) << 100.0 * found / (t * n) << "%"
+              << std::endl;
+    if (t == options.concurrency)
+      break;
+  }
+  if (mismatches) {
+    std::cout << "Error: the TBs differ in " << mismatches << " probes."
+              << std::endl;
+    return 1;
+  }
+  std::cout << "The in-memory and the loaded TB agree in all the probes."
+            << std::endl;
+  return 0;
+}
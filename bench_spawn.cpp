@@ -0,0 +1,192 @@
+// Benchmark of the expansion of the nodes with allowed_move() compiled for the
+// groups of filters in use, against the generic allowed_move() that checks all
+// the excludes at runtime. The positions are random walks through the allowed
+// part of the game trees of the EPDs in the file that have excludes known for
+// them, and both have to spawn the same children and count the same
+// rejections. The opening books of the EPDs are not used. The best of three
+// interleaved rounds is taken for each EPD, and the results are summed up
+// over the EPDs with the same groups of filters.
+//
+// Usage: ./bench_spawn [EPD file] [positions per EPD]
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "batch.hpp"
+#include "external/chess.hpp"
+#include "matetb.hpp"
+#include "options.hpp"
+
+using bench_map_t =
+    std::unordered_map<PackedBoard, index_t, key_hash_t<PackedBoard>>;
+
+// only the filters of MateTbBase are used
+class SpawnBench : public MateTbBase<bench_map_t> {
+  using Base = MateTbBase<bench_map_t>;
+  void initialize_tb() override {}
+  void connect_children() override {}
+  void generate_tb() override {}
+  void generate_tb_by_levels() override {}
+
+public:
+  using Base::active_filters, Base::mating_side, Base::spawn_children,
+      Base::spawn_children_as;
+  SpawnBench(const Options &options, std::ostream &output)
+      : Base(options, output) {}
+};
+
+struct sample_t {
+  Board board;
+  PackedBoard pfen;
+  Movelist legal_moves;
+};
+
+bool same_children(const std::vector<child_t> &a,
+                   const std::vector<child_t> &b) {
+  return std::equal(a.begin(), a.end(), b.begin(), b.end(),
+                    [](const child_t &x, const child_t &y) {
+                      return x.pfen == y.pfen && x.parent == y.parent;
+                    });
+}
+
+template <typename F> double time_it(F &&f) {
+  auto tic = std::chrono::high_resolution_clock::now();
+  f();
+  auto toc = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double>(toc - tic).count();
+}
+
+std::string filter_groups(unsigned filters) {
+  const char *names[] = {"moves", "squares", "pieces", "attacked", "replies"};
+  std::string s;
+  for (int i = 0; i < 5; ++i)
+    if (filters >> i & 1)
+      s += (s.empty() ? "" : ",") + std::string(names[i]);
+  return s;
+}
+
+// the nodes of random walks from the root of mtb with the mating side to
+// move, following its allowed moves
+std::vector<sample_t> random_walks(SpawnBench &mtb, const std::string &fen,
+                                   std::size_t n) {
+  std::mt19937_64 rng(42);
+  std::vector<sample_t> samples;
+  std::vector<child_t> children, others;
+  Board board(fen);
+  for (std::size_t nodes = 0; samples.size() < n && nodes < 100 * n;
+       ++nodes) {
+    sample_t sample{board, Board::Compact::encode(board), {}};
+    movegen::legalmoves(sample.legal_moves, sample.board);
+    children.clear();
+    mtb.spawn_children(sample.board, sample.pfen, 0, sample.legal_moves,
+                       Move::NO_MOVE, children, others, nullptr);
+    if (board.sideToMove() == mtb.mating_side && !sample.legal_moves.empty())
+      samples.push_back(sample);
+    if (children.empty() || rng() % 64 == 0)
+      board = Board(fen);
+    else
+      board = Board::Compact::decode(children[rng() % children.size()].pfen);
+  }
+  return samples;
+}
+
+int main(int argc, char **argv) {
+  std::string filename = argc > 1 ? argv[1] : "matetb.epd";
+  std::size_t n = argc > 2 ? std::stoull(argv[2]) : 5000;
+  struct timings_t {
+    std::size_t epds = 0, nodes = 0;
+    double generic = 0, specialized = 0;
+  };
+  std::map<unsigned, timings_t> by_filters;
+  for (const auto &puzzle : read_puzzles(filename)) {
+    // only the results of the benchmark are shown, the TB writes to a stream
+    // without a buffer
+    std::ostream discard(nullptr);
+    Options options = puzzle_options(Options(), puzzle);
+    SpawnBench mtb(options, discard);
+    unsigned filters = mtb.active_filters();
+    if (!filters)
+      continue;
+    auto parts = split(puzzle.epd);
+    auto samples =
+        random_walks(mtb, join(parts.begin(), parts.begin() + 4), n);
+    std::vector<child_t> children, others;
+    auto generic = [&](sample_t &sample, filter_stats_t *stats) {
+      mtb.spawn_children_as<FILTERS_ALL>(sample.board, sample.pfen, 0,
+                                         sample.legal_moves, Move::NO_MOVE,
+                                         children, others, stats);
+    };
+    auto specialized = [&](sample_t &sample, filter_stats_t *stats) {
+      mtb.spawn_children(sample.board, sample.pfen, 0, sample.legal_moves,
+                         Move::NO_MOVE, children, others, stats);
+    };
+    auto expand_all = [&](auto &&spawn) {
+      return time_it([&]() {
+        for (auto &sample : samples) {
+          children.clear();
+          others.clear();
+          spawn(sample, nullptr);
+        }
+      });
+    };
+    double t_generic = 1e9, t_specialized = 1e9;
+    for (int round = 0; round < 3; ++round) {
+      t_generic = std::min(t_generic, expand_all(generic));
+      t_specialized = std::min(t_specialized, expand_all(specialized));
+    }
+    for (auto &sample : samples) {
+      filter_stats_t expected_stats, got_stats;
+      children.clear();
+      others.clear();
+      generic(sample, &expected_stats);
+      auto expected = children, expected_others = others;
+      children.clear();
+      others.clear();
+      specialized(sample, &got_stats);
+      if (!same_children(children, expected) ||
+          !same_children(others, expected_others) ||
+          got_stats.checked != expected_stats.checked ||
+          got_stats.rejected != expected_stats.rejected) {
+        std::cout << "Error: mismatch for " << sample.board.getFen()
+                  << " of " << puzzle.epd << std::endl;
+        return 1;
+      }
+    }
+    auto &timings = by_filters[filters];
+    timings.epds++;
+    timings.nodes += samples.size();
+    timings.generic += t_generic;
+    timings.specialized += t_specialized;
+  }
+  if (by_filters.empty()) {
+    std::cout << "No EPDs with excludes found in " << filename << "."
+              << std::endl;
+    return 1;
+  }
+  std::cout << "filters                         EPDs    nodes  generic "
+               "Mnodes/s  specialized Mnodes/s  speedup"
+            << std::endl;
+  std::cout << std::fixed << std::setprecision(2);
+  timings_t total;
+  for (const auto &[filters, timings] : by_filters) {
+    std::cout << std::left << std::setw(30) << filter_groups(filters)
+              << std::right << std::setw(6) << timings.epds << std::setw(9)
+              << timings.nodes << std::setw(18)
+              << timings.nodes / timings.generic / 1e6 << std::setw(22)
+              << timings.nodes / timings.specialized / 1e6 << std::setw(8)
+              << timings.generic / timings.specialized << "x" << std::endl;
+    total.generic += timings.generic;
+    total.specialized += timings.specialized;
+  }
+  std::cout << "Total: " << total.generic << "s generic, " << total.specialized
+            << "s specialized (" << total.generic / total.specialized
+            << "x)." << std::endl;
+  return 0;
+}
@@ -0,0 +1,144 @@
+// Benchmark of the phases of the TB generation of matetb_threaded for a fixed
+// set of positions from matetb.epd, each with the excludes known for it, at
+// 1, 2, 4, ... threads. Every run is forked into its own process, so that its
+// peak RSS can be measured. The iterations are the plies of the levels solver.
+// The results are printed and written as JSON.
+//
+// Usage: ./bench_tb [max threads] [JSON file] [solver]
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "external/threadpool.hpp"
+#include "matetb_threaded.hpp"
+#include "options.hpp"
+
+const std::vector<std::string> bench_epds = {
+    "8/8/7p/5K1k/R7/8/8/8 w - - bm #6;",
+    "8/2Nb4/pp6/4rp1p/1Pp1pPkP/PpPpR3/1B1P2N1/1K6 w - - bm #5;",
+    "4R3/1n1p4/3n4/8/8/p4p2/7p/5K1k w - - bm #20;",
+    "8/3k4/3p1Q2/8/8/1p1p4/pp1p4/rrbK4 w - - bm #23;",
+};
+
+struct bench_run_t {
+  std::string epd;
+  int threads;
+  tb_stats_t stats;
+  double peak_rss_mb;
+};
+
+// creates the TB in a child process, which sends its stats through a pipe
+bool run_child(const Options &options, bench_run_t &run) {
+  int fds[2];
+  if (pipe(fds))
+    return false;
+  pid_t pid = fork();
+  if (pid < 0)
+    return false;
+  if (pid == 0) {
+    close(fds[0]);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    ThreadPool pool(options.concurrency);
+    MateTB<PackedBoard> mtb(options, pool);
+    mtb.create_tb();
+    const tb_stats_t &stats = mtb.stats();
+    bool sent = write(fds[1], &stats, sizeof(stats)) == sizeof(stats);
+    _exit(sent ? 0 : 1);
+  }
+  close(fds[1]);
+  bool received = read(fds[0], &run.stats, sizeof(run.stats)) ==
+                  sizeof(run.stats);
+  close(fds[0]);
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) != pid)
+    return false;
+  run.peak_rss_mb = usage.ru_maxrss / 1024.0; // ru_maxrss is in KB
+  return received && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+double per_second(std::size_t work, double seconds) {
+  return seconds > 0 ? work / seconds : 0;
+}
+
+int main(int argc, char **argv) {
+  int max_threads = argc > 1 ? std::stoi(argv[1])
+                             : int(std::thread::hardware_concurrency());
+  std::string filename = argc > 2 ? argv[2] : "bench.json";
+  std::string solver = argc > 3 ? argv[3] : "levels";
+  std::vector<int> thread_counts;
+  for (int threads = 1; threads < max_threads; threads *= 2)
+    thread_counts.push_back(threads);
+  thread_counts.push_back(std::max(1, max_threads));
+  std::vector<bench_run_t> runs;
+  std::cout << std::fixed;
+  for (const auto &epd : bench_epds) {
+    std::cout << epd << std::endl;
+    std::cout << "threads  positions  Mnodes/s      edges  Medges/s  "
+                 "iterations   updates  Mupdates/s  peak RSS MB"
+              << std::endl;
+    for (int threads : thread_counts) {
+      Options options;
+      options.epdStr = epd;
+      options.concurrency = threads;
+      options.solver = solver;
+      options.fill_exclude_options();
+      bench_run_t run{epd, threads, {}, 0};
+      if (!run_child(options, run)) {
+        std::cout << "Error: the run with " << threads << " threads failed."
+                  << std::endl;
+        return 1;
+      }
+      const tb_stats_t &s = run.stats;
+      std::cout << std::setw(7) << threads << std::setw(11) << s.positions
+                << std::setprecision(2) << std::setw(10)
+                << per_second(s.positions, s.tree_seconds) / 1e6
+                << std::setw(11) << s.edges << std::setw(10)
+                << per_second(s.edges, s.connect_seconds) / 1e6
+                << std::setw(12) << s.iterations << std::setw(10) << s.updates
+                << std::setw(12)
+                << per_second(s.updates, s.generate_seconds) / 1e6
+                << std::setprecision(1) << std::setw(13) << run.peak_rss_mb
+                << std::endl;
+      runs.push_back(run);
+    }
+  }
+  std::ofstream f(filename);
+  f << "{\n  \"hardware_concurrency\": " << std::thread::hardware_concurrency()
+    << ",\n  \"solver\": " << json_string(solver) << ",\n  \"runs\": [";
+  for (std::size_t i = 0; i < runs.size(); ++i) {
+    const auto &run = runs[i];
+    const tb_stats_t &s = run.stats;
+    f << (i ? ",\n" : "\n") << "    {\"epd\": " << json_string(run.epd)
+      << ", \"threads\": " << run.threads
+      << ", \"positions\": " << s.positions << ", \"edges\": " << s.edges
+      << ", \"iterations\": " << s.iterations
+      << ", \"updates\": " << s.updates << std::fixed << std::setprecision(6)
+      << ", \"tree_seconds\": " << s.tree_seconds
+      << ", \"connect_seconds\": " << s.connect_seconds
+      << ", \"generate_seconds\": " << s.generate_seconds
+      << std::setprecision(0) << ", \"nodes_per_second\": "
+      << per_second(s.positions, s.tree_seconds)
+      << ", \"edges_per_second\": " << per_second(s.edges, s.connect_seconds)
+      << ", \"updates_per_second\": "
+      << per_second(s.updates, s.generate_seconds) << std::setprecision(1)
+      << ", \"peak_rss_mb\": " << run.peak_rss_mb << "}";
+  }
+  f << "\n  ]\n}\n";
+  if (!f) {
+    std::cout << "Error writing " << filename << "." << std::endl;
+    return 1;
+  }
+  std::cout << "Wrote the results to " << filename << "." << std::endl;
+  return 0;
+}
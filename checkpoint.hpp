@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Checkpoints of the TB generation are binary files in a directory. Each file
+// is written under a temporary name and then renamed, so that an interrupted
+// run never leaves a half-written checkpoint behind.
+
+constexpr char CHECKPOINT_MAGIC[8] = {'M', 'A', 'T', 'E', 'T', 'B', 'C', '3'};
+
+template <typename T> void write_value(std::ofstream &f, const T &value) {
+  f.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T> void read_value(std::ifstream &f, T &value) {
+  f.read(reinterpret_cast<char *>(&value), sizeof(T));
+}
+
+template <typename T, typename A>
+void write_vector(std::ofstream &f, const std::vector<T, A> &v) {
+  write_value(f, std::uint64_t(v.size()));
+  f.write(reinterpret_cast<const char *>(v.data()), v.size() * sizeof(T));
+}
+
+template <typename T, typename A>
+void read_vector(std::ifstream &f, std::vector<T, A> &v) {
+  std::uint64_t size = 0;
+  read_value(f, size);
+  v.resize(size);
+  f.read(reinterpret_cast<char *>(v.data()), size * sizeof(T));
+}
+
+inline void write_string(std::ofstream &f, const std::string &s) {
+  write_vector(f, std::vector<char>(s.begin(), s.end()));
+}
+
+inline void read_string(std::ifstream &f, std::string &s) {
+  std::vector<char> v;
+  read_vector(f, v);
+  s.assign(v.begin(), v.end());
+}
+
+// writes the checkpoint dir/name with write(f)
+template <typename F>
+void write_checkpoint(const std::string &dir, const std::string &name,
+                      F &&write) {
+  std::filesystem::create_directories(dir);
+  std::string path = dir + "/" + name, tmp_path = path + ".tmp";
+  {
+    std::ofstream f(tmp_path, std::ios::binary);
+    f.write(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    write(f);
+    if (!f) {
+      std::cout << "Error writing checkpoint " << path << "." << std::endl;
+      std::exit(1);
+    }
+  }
+  std::filesystem::rename(tmp_path, path);
+}
+
+// reads the checkpoint dir/name with read(f), if it exists
+template <typename F>
+bool read_checkpoint(const std::string &dir, const std::string &name,
+                     F &&read) {
+  std::string path = dir + "/" + name;
+  if (!std::filesystem::exists(path))
+    return false;
+  std::ifstream f(path, std::ios::binary);
+  char magic[sizeof(CHECKPOINT_MAGIC)] = {};
+  f.read(magic, sizeof(magic));
+  bool valid = f && !std::memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic));
+  if (valid) {
+    read(f);
+    // the whole file has to be consumed
+    valid = f && f.peek() == std::ifstream::traits_type::eof();
+  }
+  if (!valid) {
+    std::cout << "File " << path << " is not a valid checkpoint." << std::endl;
+    std::exit(1);
+  }
+  return true;
+}
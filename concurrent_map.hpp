@@ -0,0 +1,237 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <iterator>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "misc.hpp"
+#include "stats.hpp"
+
+// A concurrent hash map from keys to indices for the creation of the game tree,
+// using open addressing with linear probing in a table of fixed capacity.
+// Inserts claim an empty slot with a CAS on its index, and are safe to run
+// concurrently with each other and with lookups. Lookups take no locks at all.
+// The index of a slot is NO_INDEX while the slot is empty, and BUSY while its
+// key is being written.
+//
+// The capacity only changes in reserve(), which must not run concurrently with
+// any other member function, and inserts beyond the capacity never return. So
+// a parallel phase inserts at most room() keys, and the table is grown between
+// the phases.
+template <typename Key, typename Hash> class ConcurrentIndexMap {
+public:
+  using key_type = Key;
+  using value_type = std::pair<Key, index_t>;
+
+  class const_iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = ConcurrentIndexMap::value_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const value_type *;
+    using reference = const value_type &;
+
+    const_iterator() = default;
+    const_iterator(pointer slot, pointer end) : slot_(slot), end_(end) {
+      skip_empty();
+    }
+    reference operator*() const { return *slot_; }
+    pointer operator->() const { return slot_; }
+    const_iterator &operator++() {
+      ++slot_;
+      skip_empty();
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator it = *this;
+      ++*this;
+      return it;
+    }
+    bool operator==(const const_iterator &other) const {
+      return slot_ == other.slot_;
+    }
+
+  private:
+    void skip_empty() {
+      while (slot_ != end_ && slot_->second == NO_INDEX)
+        ++slot_;
+    }
+    pointer slot_ = nullptr, end_ = nullptr;
+  };
+
+  ConcurrentIndexMap(std::size_t expected_size = 0) { reserve(expected_size); }
+
+  std::size_t size() const { return size_.load(std::memory_order_relaxed); }
+  std::size_t capacity() const { return slots_.size(); }
+  double load_factor() const { return double(size()) / capacity(); }
+
+  const_iterator begin() const {
+    return {slots_.data(), slots_.data() + slots_.size()};
+  }
+  const_iterator end() const {
+    return {slots_.data() + slots_.size(), slots_.data() + slots_.size()};
+  }
+
+  // the number of keys that can still be inserted without exceeding MAX_LOAD
+  std::size_t room() const {
+    std::size_t max_size = capacity() * MAX_LOAD;
+    return max_size > size() ? max_size - size() : 0;
+  }
+
+  // makes sure that n keys fit into the table without exceeding MAX_LOAD
+  void reserve(std::size_t n) {
+    std::size_t capacity = std::bit_ceil(std::max<std::size_t>(
+        MIN_CAPACITY, static_cast<std::size_t>(n / MAX_LOAD) + 1));
+    if (capacity <= slots_.size())
+      return;
+    std::vector<value_type> slots(capacity, {Key{}, NO_INDEX});
+    std::swap(slots, slots_);
+    mask_ = capacity - 1;
+    for (const auto &slot : slots)
+      if (slot.second != NO_INDEX)
+        slots_[probe(slot.first)] = slot;
+  }
+
+  // removes all the keys but keeps the capacity, which must not run
+  // concurrently with any other member function
+  void clear() {
+    std::fill(slots_.begin(), slots_.end(), value_type{Key{}, NO_INDEX});
+    size_.store(0, std::memory_order_relaxed);
+  }
+
+  // inserts key with the index returned from new_index(), unless key is already
+  // present, and returns the index of key and whether it was inserted
+  template <typename F>
+  std::pair<index_t, bool> insert(const Key &key, F &&new_index) {
+    for (std::size_t i = Hash{}(key) & mask_;; i = (i + 1) & mask_) {
+      value_type &slot = slots_[i];
+      std::atomic_ref<index_t> slot_index(slot.second);
+      index_t idx = slot_index.load(std::memory_order_acquire);
+      if (idx == NO_INDEX &&
+          slot_index.compare_exchange_strong(idx, BUSY,
+                                             std::memory_order_acquire)) {
+        slot.first = key;
+        idx = new_index();
+        slot_index.store(idx, std::memory_order_release);
+        size_.fetch_add(1, std::memory_order_relaxed);
+        return {idx, true};
+      }
+      while (idx == BUSY) {
+        std::this_thread::yield();
+        idx = slot_index.load(std::memory_order_acquire);
+      }
+      if (slot.first == key)
+        return {idx, false};
+    }
+  }
+
+  // inserts key with index idx, unless key is already present
+  bool emplace(const Key &key, index_t idx) {
+    return insert(key, [idx]() { return idx; }).second;
+  }
+
+  // the index of key, or NO_INDEX if key is not present
+  index_t find_index(const Key &key) const {
+    const value_type *slot = lookup(key);
+    return slot ? slot->second : NO_INDEX;
+  }
+
+  const_iterator find(const Key &key) const {
+    const value_type *slot = lookup(key);
+    return slot ? const_iterator(slot, slots_.data() + slots_.size()) : end();
+  }
+
+  std::size_t count(const Key &key) const { return lookup(key) != nullptr; }
+
+  // the load factor, and the slots compared by the lookups of the keys in the
+  // table, which must not run concurrently with the inserts
+  map_stats_t probe_stats() const {
+    map_stats_t stats;
+    stats.load_factor = load_factor();
+    std::size_t probes = 0;
+    for (std::size_t i = 0; i < slots_.size(); ++i)
+      if (slots_[i].second != NO_INDEX) {
+        std::size_t n = ((i - Hash{}(slots_[i].first)) & mask_) + 1;
+        probes += n;
+        stats.max_probe = std::max(stats.max_probe, n);
+      }
+    stats.mean_probe = size() ? double(probes) / size() : 0;
+    return stats;
+  }
+
+  // replaces every index idx by new_index[idx], and removes the keys with
+  // new_index[idx] == NO_INDEX, which must not run concurrently with any other
+  // member function
+  void remap(const std::vector<index_t> &new_index) {
+    // an empty slot, which no probe sequence passes
+    std::size_t start = 0;
+    while (slots_[start].second != NO_INDEX)
+      ++start;
+    std::size_t removed = 0;
+    for (auto &slot : slots_)
+      if (slot.second != NO_INDEX)
+        removed += (slot.second = new_index[slot.second]) == NO_INDEX;
+    if (!removed)
+      return;
+    // the keys behind a removed one may no longer be found by linear probing,
+    // so they are inserted again in place, in the order of the probe sequences
+    // after start: each key moves at most back to a slot freed before it
+    for (std::size_t n = 1; n < slots_.size(); ++n) {
+      std::size_t i = (start + n) & mask_;
+      if (slots_[i].second == NO_INDEX)
+        continue;
+      value_type slot = slots_[i];
+      slots_[i].second = NO_INDEX;
+      slots_[probe(slot.first)] = slot;
+    }
+    size_.fetch_sub(removed, std::memory_order_relaxed);
+  }
+
+private:
+  static constexpr index_t BUSY = NO_INDEX - 1;
+  static constexpr double MAX_LOAD = 0.75;
+  static constexpr std::size_t MIN_CAPACITY = 1 << 10;
+
+  // the slot that holds key, or nullptr
+  const value_type *lookup(const Key &key) const {
+    for (std::size_t i = Hash{}(key) & mask_;; i = (i + 1) & mask_) {
+      const value_type &slot = slots_[i];
+      std::atomic_ref<index_t> slot_index(const_cast<index_t &>(slot.second));
+      index_t idx;
+      while ((idx = slot_index.load(std::memory_order_acquire)) == BUSY)
+        std::this_thread::yield();
+      if (idx == NO_INDEX)
+        return nullptr;
+      if (slot.first == key)
+        return &slot;
+    }
+  }
+
+  // the first slot that is either empty or holds key, for single-threaded use
+  std::size_t probe(const Key &key) const {
+    std::size_t i = Hash{}(key) & mask_;
+    while (slots_[i].second != NO_INDEX && slots_[i].first != key)
+      i = (i + 1) & mask_;
+    return i;
+  }
+
+  std::vector<value_type> slots_;
+  std::size_t mask_ = 0;
+  std::atomic<std::size_t> size_ = 0;
+};
+
+template <typename Key, typename Hash>
+void remap_indices(ConcurrentIndexMap<Key, Hash> &map,
+                   const std::vector<index_t> &new_index) {
+  map.remap(new_index);
+}
+
+template <typename Key, typename Hash>
+map_stats_t index_map_stats(const ConcurrentIndexMap<Key, Hash> &map) {
+  return map.probe_stats();
+}
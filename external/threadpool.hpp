@@ -1,72 +1,224 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
-#include <functional>
-#include <future>
-#include <queue>
-#include <stdexcept>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
 #include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// A persistent thread pool with work stealing for parallel loops.
+//
+// parallel_for(n, grain, func) splits [0, n) into chunks of size grain and
+// deals out contiguous ranges of chunks to the workers, including the calling
+// thread. Each worker takes chunks from the front of its own range, and an idle
+// worker steals the back half of another worker's range. The ranges are packed
+// into a single atomic word each, so no locks or heap allocations are needed
+// per chunk. The callable is invoked as func(begin, end) or as
+// func(begin, end, thread_id), with 0 <= thread_id < size().
+//
+// static_for(n, func) instead gives the i-th of size() equal parts of [0, n) to
+// thread i, without stealing, so that with pin_threads() the same part of an
+// array is always processed on the same core.
 class ThreadPool {
 public:
-  ThreadPool(std::size_t num_threads) : stop_(false) {
-    for (std::size_t i = 0; i < num_threads; ++i)
-      workers_.emplace_back([this] { work(); });
+  ThreadPool(std::size_t num_threads)
+      : ranges_(std::max<std::size_t>(1, num_threads)) {
+    for (std::size_t i = 1; i < ranges_.size(); ++i)
+      workers_.emplace_back([this, i] { work(i); });
   }
 
-  template <class F, class... Args> void enqueue(F &&func, Args &&...args) {
-    auto task = std::make_shared<std::packaged_task<void()>>(
-        std::bind(std::forward<F>(func), std::forward<Args>(args)...));
-
+  ~ThreadPool() {
     {
-      std::unique_lock<std::mutex> lock(queue_mutex_);
-      if (stop_)
-        throw std::runtime_error("Warning: enqueue on stopped ThreadPool");
-      tasks_.emplace([task]() { (*task)(); });
+      std::unique_lock<std::mutex> lock(mutex_);
+      stop_ = true;
     }
-    condition_.notify_one();
+    start_.notify_all();
+    for (auto &worker : workers_)
+      worker.join();
   }
 
-  ~ThreadPool() { wait(); }
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
 
-  void wait() {
-    if (stop_)
-      return;
+  std::size_t size() const { return ranges_.size(); }
 
+  // pins thread i (the calling thread for i = 0) to the i-th CPU that the
+  // process may run on, returns false if that is not supported
+  bool pin_threads() {
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed))
+      return false;
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+      if (CPU_ISSET(cpu, &allowed))
+        cpus.push_back(cpu);
+    bool pinned = !cpus.empty();
+    for (std::size_t i = 0; pinned && i < size(); ++i) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpus[i % cpus.size()], &set);
+      pthread_t thread = i ? workers_[i - 1].native_handle() : pthread_self();
+      pinned = pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+    }
+    return pinned;
+#else
+    return false;
+#endif
+  }
+
+  // the part of [0, n) that static_for() gives to thread i
+  std::pair<std::size_t, std::size_t> static_range(std::size_t n,
+                                                   std::size_t i) const {
+    return {n * i / size(), n * (i + 1) / size()};
+  }
+
+  template <class F> void static_for(std::size_t n, F &&func) {
+    steal_ = false;
+    parallel_for(size(), 1, [&](std::size_t i, std::size_t, std::size_t id) {
+      auto [begin, end] = static_range(n, i);
+      if (begin < end)
+        call(func, begin, end, id);
+    });
+    steal_ = true;
+  }
+
+  template <class F>
+  void parallel_for(std::size_t n, std::size_t grain, F &&func) {
+    if (n == 0)
+      return;
+    grain = std::max<std::size_t>(1, grain);
+    std::size_t chunks = (n + grain - 1) / grain;
+    if (chunks == 1 || size() == 1) {
+      for (std::size_t begin = 0; begin < n; begin += grain)
+        call(func, begin, std::min(begin + grain, n), 0);
+      return;
+    }
+    using Func = std::remove_reference_t<F>;
+    n_ = n;
+    grain_ = grain;
+    context_ = const_cast<void *>(static_cast<const void *>(&func));
+    invoke_ = [](void *context, std::size_t begin, std::size_t end,
+                 std::size_t thread_id) {
+      call(*static_cast<Func *>(context), begin, end, thread_id);
+    };
+    for (std::size_t i = 0; i < size(); ++i)
+      ranges_[i].bounds.store(
+          pack(chunks * i / size(), chunks * (i + 1) / size()),
+          std::memory_order_relaxed);
     {
-      std::unique_lock<std::mutex> lock(queue_mutex_);
-      stop_ = true;
+      std::unique_lock<std::mutex> lock(mutex_);
+      active_ = workers_.size();
+      generation_++;
     }
+    start_.notify_all();
+    run(0);
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this] { return active_ == 0; });
+  }
+
+private:
+  struct alignas(64) Range {
+    std::atomic<std::uint64_t> bounds{0}; // chunks [begin, end) as (32, 32)
+  };
+
+  static std::uint64_t pack(std::uint64_t begin, std::uint64_t end) {
+    return begin << 32 | end;
+  }
 
-    condition_.notify_all();
+  template <class F>
+  static void call(F &func, std::size_t begin, std::size_t end,
+                   std::size_t thread_id) {
+    if constexpr (std::is_invocable_v<F &, std::size_t, std::size_t,
+                                      std::size_t>)
+      func(begin, end, thread_id);
+    else
+      func(begin, end);
+  }
 
-    for (auto &worker : workers_) {
-      if (worker.joinable()) {
-        worker.join();
+  // takes the first chunk of the own range
+  bool pop(std::size_t id, std::uint64_t &chunk) {
+    auto &bounds = ranges_[id].bounds;
+    std::uint64_t old = bounds.load(std::memory_order_relaxed);
+    while (true) {
+      std::uint64_t begin = old >> 32, end = old & 0xffffffff;
+      if (begin >= end)
+        return false;
+      if (bounds.compare_exchange_weak(old, pack(begin + 1, end),
+                                       std::memory_order_acq_rel)) {
+        chunk = begin;
+        return true;
       }
     }
   }
 
-private:
-  void work() {
+  // moves the back half of another worker's range to the own range
+  bool steal(std::size_t id) {
+    for (std::size_t k = 1; k < size(); ++k) {
+      auto &bounds = ranges_[(id + k) % size()].bounds;
+      std::uint64_t old = bounds.load(std::memory_order_relaxed);
+      while (true) {
+        std::uint64_t begin = old >> 32, end = old & 0xffffffff;
+        if (begin >= end)
+          break;
+        std::uint64_t mid = end - std::max<std::uint64_t>(1, (end - begin) / 2);
+        if (bounds.compare_exchange_weak(old, pack(begin, mid),
+                                         std::memory_order_acq_rel)) {
+          ranges_[id].bounds.store(pack(mid, end), std::memory_order_release);
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  void run(std::size_t id) {
+    std::uint64_t chunk;
+    do {
+      while (pop(id, chunk)) {
+        std::size_t begin = chunk * grain_;
+        invoke_(context_, begin, std::min(begin + grain_, n_), id);
+      }
+    } while (steal_ && steal(id));
+  }
+
+  void work(std::size_t id) {
+    std::size_t generation = 0;
     while (true) {
-      std::function<void()> task;
       {
-        std::unique_lock<std::mutex> lock(queue_mutex_);
-        condition_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
-        if (stop_ && tasks_.empty())
+        std::unique_lock<std::mutex> lock(mutex_);
+        start_.wait(lock, [this, generation] {
+          return stop_ || generation_ != generation;
+        });
+        if (stop_)
           return;
-        task = std::move(tasks_.front());
-        tasks_.pop();
+        generation = generation_;
       }
-      task();
+      run(id);
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (--active_ == 0)
+        done_.notify_one();
     }
   }
 
+  std::vector<Range> ranges_;
   std::vector<std::thread> workers_;
-  std::queue<std::function<void()>> tasks_;
-  std::mutex queue_mutex_;
-  std::condition_variable condition_;
+  std::mutex mutex_;
+  std::condition_variable start_, done_;
+  std::size_t generation_ = 0, active_ = 0;
+  bool stop_ = false, steal_ = true;
 
-  std::atomic_bool stop_;
+  // the current loop
+  std::size_t n_ = 0, grain_ = 1;
+  void *context_ = nullptr;
+  void (*invoke_)(void *, std::size_t, std::size_t, std::size_t) = nullptr;
 };
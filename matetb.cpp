@@ -2,163 +2,381 @@
 #include <chrono>
 #include <iostream>
 #include <map>
-#include <queue>
+#include <memory>
+#include <utility>
 #include <vector>
 
+#include "batch.hpp"
 #include "external/chess.hpp"
 #include "matetb.hpp"
 
 using namespace chess;
 
 // unordered map to map FENs from game tree to their index idx
-using index_map_t = std::unordered_map<PackedBoard, index_t, PackedBoardHash>;
+template <typename Key>
+using index_map_t = std::unordered_map<Key, index_t, key_hash_t<Key>>;
 
-class MateTB : public MateTbBase<index_map_t> {
+template <typename Key> class MateTB : public MateTbBase<index_map_t<Key>> {
+  using Base = MateTbBase<index_map_t<Key>>;
+  using Base::best_child_score, Base::canonical, Base::check_key,
+      Base::checkpoint_due, Base::checkpoint_iteration, Base::checkpoint_scores,
+      Base::collect_stats, Base::compact_scores, Base::connect_unconnected,
+      Base::deepen_from, Base::details, Base::edges, Base::expand_scores,
+      Base::fen2index, Base::find_index, Base::frontier, Base::keep_frontier,
+      Base::max_depth, Base::openingBook, Base::out, Base::position_limit,
+      Base::reconnect_resumed_node, Base::root_pos, Base::scored_levels,
+      Base::set_key_check, Base::spawn_all_children, Base::spawn_children,
+      Base::stats_, Base::tb, Base::unconnected, Base::verbose;
   void initialize_tb();
   void connect_children();
   void generate_tb();
+  void generate_tb_by_levels();
+  template <typename T>
+  int resolve_levels(std::vector<std::vector<index_t>> &levels, int ply,
+                     uninit_vector_t<std::uint8_t> &unresolved);
 
 public:
-  MateTB(const Options &options) : MateTbBase<index_map_t>(options) {}
+  MateTB(const Options &options, std::ostream &output = std::cout)
+      : Base(options, output) {}
 };
 
-void MateTB::initialize_tb() {
+// The tree is created with a BFS, and the children of a node reached with
+// allowed moves go into the next level while it is expanded (and they connect
+// to their parent when it is visited). The children reached with other moves,
+// and all the children of the nodes at max_depth, are connected at once if they
+// are in the tree, and the others are left to connect_children() in
+// unconnected. The two levels are swapped and reused, so their memory is only
+// allocated for the largest level. A deepened tree first expands its frontier
+// again.
+template <typename Key> void MateTB<Key>::initialize_tb() {
   auto tic = std::chrono::high_resolution_clock::now();
-  std::cout << "Create the allowed part of the game tree ..." << std::endl;
-  int count = 0, depth = 0;
-  std::queue<std::pair<PackedBoard, int>> q;
-  q.push(std::pair<PackedBoard, int>(Board::Compact::encode(root_pos), depth));
-  while (!q.empty()) {
-    auto pair = q.front();
-    const PackedBoard &pfen = pair.first;
-    depth = pair.second;
-    if (depth > max_depth) {
-      depth--;
-      break;
-    }
-    q.pop();
-    if (fen2index.count(pfen)) // is pfen already a key in the map?
-      continue;
-    fen2index[pfen] = count++;
-    if (count % 1000 == 0)
-      std::cout << "Progress: " << count << " (d" << depth << ")\r"
-                << std::flush;
+  out << "Create the allowed part of the game tree ..." << std::endl;
+  int count = fen2index.size(), depth = std::max(deepen_from, 0);
+  edges.assign(1, {});
+  unconnected.assign(1, {});
+  filter_stats_t *filter_stats = collect_stats ? &details.filters : nullptr;
+  std::vector<child_t> level, next_level;
+  // appends the allowed children of the node idx at node_depth to next_level,
+  // and returns its score (-VALUE_MATE if it is mate)
+  auto expand = [&](const PackedBoard &pfen, index_t idx, int node_depth) {
     auto board = Board::Compact::decode(pfen);
     Movelist legal_moves;
     movegen::legalmoves(legal_moves, board);
     score_t score =
         legal_moves.size() == 0 && board.inCheck() ? -VALUE_MATE : 0;
-    tb.emplace_back(score, std::vector<index_t>());
     if (score)
-      continue;
-    std::string onlyMove;
-    if (!openingBook.empty()) {
-      std::string fen = board.getFen(false);
-      if (openingBook.count(fen))
-        onlyMove = openingBook[fen];
-      if (verbose >= 3 && !onlyMove.empty()) {
-        std::cout << "Picked move " << onlyMove << " for " << fen << "."
-                  << std::endl;
+      return score;
+    auto &other_children = unconnected[0];
+    std::size_t first_other = other_children.size();
+    if (node_depth >= max_depth)
+      spawn_all_children(board, pfen, idx, legal_moves, other_children);
+    else {
+      Move book_move = openingBook.find(pfen, node_depth);
+      if (verbose >= 3 && book_move != Move::NO_MOVE) {
+        out << "Picked move " << uci::moveToUci(book_move) << " for "
+            << board.getFen(false) << "." << std::endl;
         if (verbose >= 4) {
-          std::cout << "Remaining book: ";
-          for (const auto &entry : openingBook)
-            std::cout << entry.first << ": " << entry.second << ", ";
-          std::cout << std::endl;
+          out << "Remaining book: ";
+          for (const auto &entry : openingBook.fens)
+            out << entry.first << ": " << entry.second << ", ";
+          out << std::endl;
         }
       }
+      spawn_children(board, pfen, idx, legal_moves, book_move, next_level,
+                     other_children, filter_stats);
     }
-    for (const Move &move : legal_moves) {
-      if (!onlyMove.empty() && move != uci::uciToMove(board, onlyMove))
-        continue;
-      if (onlyMove.empty() && !allowed_move(board, move))
+    // the other children already in the tree are connected at once
+    auto connected = std::remove_if(
+        other_children.begin() + first_other, other_children.end(),
+        [&](const child_t &child) {
+          index_t child_idx = find_index(child.pfen);
+          if (child_idx != NO_INDEX)
+            edges[0].emplace_back(child.parent, child_idx);
+          return child_idx != NO_INDEX;
+        });
+    other_children.erase(connected, other_children.end());
+    return score;
+  };
+  int level_depth = depth;
+  if (deepen_from < 0)
+    level.push_back({Board::Compact::encode(root_pos), NO_INDEX});
+  else {
+    level_depth++;
+    for (const auto &node : std::exchange(frontier, {}))
+      expand(node.pfen, node.idx, deepen_from);
+    std::swap(level, next_level);
+  }
+  // the limit of limit_positions() is checked for each child
+  auto over_limit = [&]() {
+    return position_limit && std::size_t(count) > position_limit;
+  };
+  for (; !level.empty() && !over_limit(); level_depth++) {
+    depth = level_depth;
+    for (const auto &child : level) {
+      if (over_limit())
+        break;
+      PackedBoard pfen = canonical(child.pfen);
+      Key key = position_key<Key>(pfen);
+      auto it = fen2index.find(key);
+      if (it != fen2index.end()) { // is pfen already a key in the map?
+        check_key(it->second, pfen);
+        edges[0].emplace_back(child.parent, it->second);
+        if (collect_stats)
+          details.count_depth(depth, 0, 1);
         continue;
-      board.makeMove<true>(move);
-      q.push(std::pair<PackedBoard, int>(Board::Compact::encode(board),
-                                         depth + 1));
-      board.unmakeMove(move);
+      }
+      if (collect_stats)
+        details.count_depth(depth, 1, 0);
+      index_t idx = fen2index[key] = count++;
+      set_key_check(idx, pfen);
+      if (child.parent != NO_INDEX)
+        edges[0].emplace_back(child.parent, idx);
+      if (count % 1000 == 0)
+        out << "Progress: " << count << " (d" << depth << ")\r" << std::flush;
+      if (depth == max_depth && keep_frontier())
+        frontier.push_back({pfen, idx});
+      tb.scores.push_back(expand(pfen, idx, depth));
     }
+    level.clear();
+    std::swap(level, next_level);
   }
   auto toc = std::chrono::high_resolution_clock::now();
   double duration =
       std::chrono::duration_cast<std::chrono::milliseconds>(toc - tic).count() /
       1000.0;
-  std::cout << "Found " << count << " positions to depth " << depth << " in "
-            << std::fixed << std::setprecision(2) << duration << "s"
-            << std::endl;
+  stats_.positions = count;
+  stats_.tree_seconds = std::chrono::duration<double>(toc - tic).count();
+  out << "Found " << count << " positions to depth " << depth << " in "
+      << std::fixed << std::setprecision(2) << duration << "s" << std::endl;
 }
 
-void MateTB::connect_children() {
+// The children left by initialize_tb() are looked up in fen2index, without
+// spawning them again. The nodes of a deepened tree before deepen_from are
+// visited with a BFS of the old tree along the allowed moves, which sets their
+// flags in visited.
+template <typename Key> void MateTB<Key>::connect_children() {
   auto tic = std::chrono::high_resolution_clock::now();
-  std::cout << "Connect child nodes ..." << std::endl;
-  size_t dim = fen2index.size(), count = 0;
-  for (const auto &[pfen, idx] : fen2index) {
-    count++;
-    if (tb[idx].first) // do not add children to mate nodes
-      continue;
-    auto board = Board::Compact::decode(pfen);
-    Movelist legal_moves;
-    movegen::legalmoves(legal_moves, board);
-    for (const Move &move : legal_moves) {
-      board.makeMove<true>(move);
-      auto child_pfen = Board::Compact::encode(board);
-      auto it = fen2index.find(child_pfen);
-      if (it != fen2index.end()) {
-        index_t childidx = it->second;
-        tb[idx].second.push_back(childidx);
-      }
-      board.unmakeMove(move);
+  out << "Connect child nodes ..." << std::endl;
+  size_t dim = fen2index.size();
+  connect_unconnected(unconnected[0].data(),
+                      unconnected[0].data() + unconnected[0].size(), edges[0]);
+  unconnected.clear();
+  if (deepen_from > 0) {
+    std::vector<child_t> children, other_children;
+    std::vector<bool> visited(dim, false);
+    auto visit = [&](index_t idx) {
+      bool first_visit = !visited[idx];
+      visited[idx] = true;
+      return first_visit;
+    };
+    PackedBoard root = canonical(Board::Compact::encode(root_pos));
+    std::vector<node_t> level{{root, find_index(root)}}, next_level;
+    visited[level[0].idx] = true;
+    for (int depth = 0; !level.empty(); ++depth) {
+      for (const auto &node : level)
+        reconnect_resumed_node(node, depth, visit, next_level, edges[0],
+                               children, other_children);
+      level.clear();
+      std::swap(level, next_level);
     }
-    if (count % 10000 == 0)
-      std::cout << "Progress: " << count << "/" << dim << "\r" << std::flush;
   }
+  build_csr(tb.children, dim, edges);
+  edges.clear();
+  tb.parents = reverse_csr(tb.children);
   auto toc = std::chrono::high_resolution_clock::now();
   double duration =
       std::chrono::duration_cast<std::chrono::milliseconds>(toc - tic).count() /
       1000.0;
-  std::cout << "Connected " << tb.size() << " positions in " << std::fixed
-            << std::setprecision(2) << duration << "s" << std::endl;
+  stats_.edges = tb.children.edges.size();
+  stats_.connect_seconds = std::chrono::duration<double>(toc - tic).count();
+  out << "Connected " << tb.size() << " positions in " << std::fixed
+      << std::setprecision(2) << duration << "s" << std::endl;
 }
 
-void MateTB::generate_tb() {
+// Retrograde analysis: starting from the parents of the mate nodes, only the
+// parents of nodes whose score changed in one iteration are re-evaluated in
+// the next one. This converges to the same scores as repeated full sweeps.
+template <typename Key> void MateTB<Key>::generate_tb() {
   auto tic = std::chrono::high_resolution_clock::now();
-  std::cout << "Generate tablebase ..." << std::endl;
-  int iteration = 0, changed = 1;
-  while (changed) {
-    changed = 0;
-    for (int i = tb.size() - 1; i >= 0; --i) {
-      score_t best_score = VALUE_NONE;
-      for (index_t child : tb[i].second) {
-        score_t score = tb[child].first;
-        if (score)
-          score = -score + (score > 0 ? 1 : -1);
-        if (best_score == VALUE_NONE || score > best_score)
-          best_score = score;
-      }
-      if (best_score != VALUE_NONE && tb[i].first != best_score) {
-        tb[i].first = best_score;
+  out << "Generate tablebase ..." << std::endl;
+  std::vector<index_t> frontier;
+  std::vector<bool> queued(tb.size(), false);
+  for (index_t idx = 0; idx < tb.size(); ++idx)
+    if (tb.scores[idx])
+      for (index_t parent : tb.parents[idx])
+        if (!queued[parent]) {
+          queued[parent] = true;
+          frontier.push_back(parent);
+        }
+  int iteration = 0;
+  while (!frontier.empty()) {
+    std::vector<index_t> next_frontier;
+    int changed = 0;
+    for (index_t idx : frontier) {
+      queued[idx] = false;
+      score_t best_score = best_child_score(idx);
+      if (best_score != VALUE_NONE && tb.scores[idx] != best_score) {
+        tb.scores[idx] = best_score;
         changed++;
+        for (index_t parent : tb.parents[idx])
+          if (!queued[parent]) {
+            queued[parent] = true;
+            next_frontier.push_back(parent);
+          }
       }
     }
+    stats_.updates += frontier.size();
+    if (collect_stats)
+      details.changed.push_back(changed);
+    frontier = std::move(next_frontier);
     iteration++;
-    std::cout << "Iteration " << iteration << ", changed " << std::setw(9)
-              << changed << " scores\r" << std::flush;
+    out << "Iteration " << iteration << ", changed " << std::setw(9) << changed
+        << " scores\r" << std::flush;
+    checkpoint_iteration(iteration);
   }
   auto toc = std::chrono::high_resolution_clock::now();
   double duration =
       std::chrono::duration_cast<std::chrono::milliseconds>(toc - tic).count() /
       1000.0;
-  std::cout << "Tablebase generated with " << iteration << " iterations in "
-            << std::fixed << std::setprecision(2) << duration << "s"
-            << std::endl;
+  stats_.iterations = iteration;
+  stats_.generate_seconds = std::chrono::duration<double>(toc - tic).count();
+  out << "Tablebase generated with " << iteration << " iterations in "
+      << std::fixed << std::setprecision(2) << duration << "s" << std::endl;
 }
 
-int main(int argc, char **argv) {
-  Options options(argc, argv);
-  std::cout << "Running with options " << options << std::endl;
-  MateTB mtb(options);
-  mtb.create_tb();
+// Retrograde analysis by increasing distance to mate: the scores resolved at
+// ply p are final, so the unresolved parents of the lost nodes at ply p are won
+// at ply p + 1, and a parent is lost at ply p + 1 once the last of its children
+// has been resolved as won. Each node is resolved at most once, and keeps a
+// counter of its children that are not yet known to be won. The scores are
+// compact scores of a byte during the analysis, and only mates beyond
+// max_compact_ply() widen them to 16 bits.
+template <typename Key> void MateTB<Key>::generate_tb_by_levels() {
+  auto tic = std::chrono::high_resolution_clock::now();
+  out << "Generate tablebase ..." << std::endl;
+  std::vector<std::vector<index_t>> levels = scored_levels();
+  uninit_vector_t<std::uint8_t> unresolved(tb.size()); // at most 218 moves
+  for (index_t idx = 0; idx < tb.size(); ++idx)
+    unresolved[idx] = tb.children[idx].size();
+  int ply = 0;
+  if (int(levels.size()) <= max_compact_ply<std::uint8_t>() + 1)
+    ply = resolve_levels<std::uint8_t>(levels, ply, unresolved);
+  if (ply < int(levels.size())) {
+    out << "Widen the scores to 16 bits at ply " << ply << "." << std::endl;
+    ply = resolve_levels<std::uint16_t>(levels, ply, unresolved);
+  }
+  auto toc = std::chrono::high_resolution_clock::now();
+  double duration =
+      std::chrono::duration_cast<std::chrono::milliseconds>(toc - tic).count() /
+      1000.0;
+  stats_.iterations = ply;
+  stats_.generate_seconds = std::chrono::duration<double>(toc - tic).count();
+  out << "Tablebase generated with " << ply << " plies in " << std::fixed
+      << std::setprecision(2) << duration << "s" << std::endl;
+}
+
+// Resolves the levels from ply on with the scores held as compact scores of
+// type T, which also mark the resolved nodes, until all the levels are done or
+// the next one does not fit into T. Returns the first unresolved ply.
+template <typename Key>
+template <typename T>
+int MateTB<Key>::resolve_levels(std::vector<std::vector<index_t>> &levels,
+                                int ply,
+                                uninit_vector_t<std::uint8_t> &unresolved) {
+  size_t dim = tb.size();
+  uninit_vector_t<T> compact(dim);
+  compact_scores(compact, 0, dim);
+  uninit_vector_t<score_t>().swap(tb.scores);
+  auto expand = [&]() {
+    tb.scores.resize(dim);
+    expand_scores(compact, 0, dim);
+  };
+  for (; ply < int(levels.size()) && ply + 1 <= max_compact_ply<T>(); ++ply) {
+    std::vector<index_t> next_level;
+    bool lost = ply % 2 == 0;
+    T parent_score = ply + 2;
+    for (index_t idx : levels[ply])
+      for (index_t parent : tb.parents[idx])
+        if (!compact[parent] && (lost || --unresolved[parent] == 0)) {
+          compact[parent] = parent_score;
+          next_level.push_back(parent);
+        }
+    out << "Ply " << ply << ", resolved " << std::setw(9) << levels[ply].size()
+        << " scores\r" << std::flush;
+    stats_.updates += levels[ply].size();
+    if (collect_stats)
+      details.changed.push_back(levels[ply].size());
+    std::vector<index_t>().swap(levels[ply]);
+    if (!next_level.empty()) {
+      if (int(levels.size()) == ply + 1)
+        levels.emplace_back();
+      levels[ply + 1].insert(levels[ply + 1].end(), next_level.begin(),
+                             next_level.end());
+    }
+    if (checkpoint_due(ply + 1)) {
+      expand();
+      checkpoint_scores(false);
+      uninit_vector_t<score_t>().swap(tb.scores);
+    }
+  }
+  expand();
+  return ply;
+}
+
+template <typename Key>
+void run(const Options &options, std::unique_ptr<TbFile> tb_file) {
+  MateTB<Key> mtb(options);
+  if (tb_file)
+    mtb.load_tb(std::move(tb_file));
+  else
+    mtb.create_tb();
   mtb.output();
   if (!options.outFile.empty())
     mtb.write_tb(options.outFile);
+  if (!options.saveTb.empty()) {
+    std::ostringstream ss;
+    ss << options;
+    mtb.save_tb(options.saveTb, ss.str());
+  }
+}
+
+// solves the puzzles of --epdFile one after the other, all with the same TB
+template <typename Key> bool run_batch(const Options &options) {
+  auto puzzles = read_puzzles(options.epdFile);
+  BatchOutput out;
+  std::unique_ptr<MateTB<Key>> mtb;
+  for (auto &puzzle : puzzles) {
+    if (!puzzle.done()) {
+      Options puzzle_opts = puzzle_options(options, puzzle);
+      if (mtb)
+        mtb->reset(puzzle_opts);
+      else
+        mtb = std::make_unique<MateTB<Key>>(puzzle_opts);
+      puzzle.threads = 1;
+      solve_puzzle(*mtb, puzzle);
+    }
+    out.print(puzzle);
+  }
+  return out.finish(puzzles, options.resultsFile);
+}
+
+int main(int argc, char **argv) {
+  Options options(argc, argv);
+  std::unique_ptr<TbFile> tb_file;
+  if (!options.loadTb.empty()) {
+    tb_file = std::make_unique<TbFile>(options.loadTb);
+    options.epdStr = tb_file->epd();
+    options.keyMode = tb_file->key_mode();
+  }
+  std::cout << "Running with options " << options << std::endl;
+  if (!options.epdFile.empty()) {
+    bool passed = options.keyMode == "packed" ? run_batch<PackedBoard>(options)
+                                              : run_batch<ZobristKey>(options);
+    return passed ? 0 : 1;
+  }
+  if (options.keyMode == "packed")
+    run<PackedBoard>(options, std::move(tb_file));
+  else
+    run<ZobristKey>(options, std::move(tb_file));
   return 0;
 }
@@ -1,18 +1,39 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <bit>
+#include <chrono>
 #include <cstdint>
+#include <cstdlib>
+#include <filesystem>
 #include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <numeric>
+#include <queue>
+#include <span>
 #include <string>
 #include <string_view>
 #include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "checkpoint.hpp"
 #include "external/chess.hpp"
 #include "misc.hpp"
 #include "options.hpp"
+#include "stats.hpp"
+#include "tb_file.hpp"
 
 using namespace chess;
 
@@ -26,8 +47,238 @@ struct PackedBoardHash {
   }
 };
 
-// a vector with idx -> {score, children}, children being a vector of indices
-using tb_t = std::vector<std::pair<score_t, std::vector<index_t>>>;
+// random keys for a Zobrist hash of a PackedBoard: one key for each of the 16
+// nibble values (a piece, possibly with castling rights, en passant or the side
+// to move) on each of the 64 squares
+inline constexpr auto ZOBRIST_NIBBLE_KEYS = [] {
+  std::array<std::array<std::uint64_t, 64>, 16> keys{};
+  std::uint64_t state = 0; // splitmix64
+  for (auto &nibble_keys : keys)
+    for (auto &key : nibble_keys) {
+      std::uint64_t z = state += 0x9E3779B97F4A7C15;
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+      key = z ^ (z >> 31);
+    }
+  return keys;
+}();
+
+using ZobristKey = std::uint64_t;
+
+// the Zobrist key of a PackedBoard, computed without decoding it: the pieces
+// are stored as nibbles from offset 16 on, in the order of the occupied squares
+inline ZobristKey zobrist_key(const PackedBoard &pfen) {
+  std::uint64_t occ = 0;
+  for (int i = 0; i < 8; ++i)
+    occ = occ << 8 | pfen[i];
+  ZobristKey key = 0;
+  for (int offset = 16; occ; occ &= occ - 1, ++offset) {
+    int nibble = (pfen[offset / 2] >> (offset % 2 == 0 ? 4 : 0)) & 0xF;
+    key ^= ZOBRIST_NIBBLE_KEYS[nibble][std::countr_zero(occ)];
+  }
+  return key;
+}
+
+// Zobrist keys are already uniformly distributed
+struct ZobristKeyHash {
+  size_t operator()(ZobristKey key) const { return key; }
+};
+
+// the key of a position in fen2index: the PackedBoard itself or its Zobrist key
+template <typename Key> Key position_key(const PackedBoard &pfen) {
+  if constexpr (std::is_same_v<Key, PackedBoard>)
+    return pfen;
+  else
+    return zobrist_key(pfen);
+}
+
+template <typename Key>
+using key_hash_t = std::conditional_t<std::is_same_v<Key, PackedBoard>,
+                                      PackedBoardHash, ZobristKeyHash>;
+
+// a graph in compressed sparse row format: the edges of node idx are
+// edges[offsets[idx]], ..., edges[offsets[idx + 1] - 1]
+struct csr_t {
+  uninit_vector_t<std::size_t> offsets = {0};
+  uninit_vector_t<index_t> edges;
+
+  std::size_t size() const { return offsets.size() - 1; }
+  std::span<const index_t> operator[](index_t idx) const {
+    return {edges.data() + offsets[idx], edges.data() + offsets[idx + 1]};
+  }
+};
+
+using edge_t = std::pair<index_t, index_t>; // {from, to}
+
+// two-pass count-then-fill build of a graph with dim nodes from lists of edges
+inline void build_csr(csr_t &csr, std::size_t dim,
+                      const std::vector<std::vector<edge_t>> &edge_lists) {
+  csr.offsets.assign(dim + 1, 0);
+  for (const auto &edge_list : edge_lists)
+    for (const auto &edge : edge_list)
+      csr.offsets[edge.first]++;
+  std::partial_sum(csr.offsets.begin(), csr.offsets.end(), csr.offsets.begin());
+  csr.edges.resize(csr.offsets[dim]);
+  // fill each node's edges backwards, so that afterwards offsets[idx] points
+  // to the start of the edges of idx
+  for (const auto &edge_list : edge_lists)
+    for (const auto &edge : edge_list)
+      csr.edges[--csr.offsets[edge.first]] = edge.second;
+}
+
+// the graph with all the edges of csr reversed
+inline csr_t reverse_csr(const csr_t &csr) {
+  csr_t reversed;
+  std::size_t dim = csr.size();
+  reversed.offsets.assign(dim + 1, 0);
+  for (index_t to : csr.edges)
+    reversed.offsets[to]++;
+  std::partial_sum(reversed.offsets.begin(), reversed.offsets.end(),
+                   reversed.offsets.begin());
+  reversed.edges.resize(csr.edges.size());
+  for (index_t idx = 0; idx < dim; ++idx)
+    for (index_t to : csr[idx])
+      reversed.edges[--reversed.offsets[to]] = idx;
+  return reversed;
+}
+
+// the graph with node idx renumbered to new_index[idx], and the edges of each
+// node sorted
+inline csr_t permute_csr(const csr_t &csr,
+                         const std::vector<index_t> &new_index) {
+  csr_t permuted;
+  std::size_t dim = csr.size();
+  permuted.offsets.assign(dim + 1, 0);
+  for (index_t idx = 0; idx < dim; ++idx)
+    permuted.offsets[new_index[idx] + 1] = csr[idx].size();
+  std::partial_sum(permuted.offsets.begin(), permuted.offsets.end(),
+                   permuted.offsets.begin());
+  permuted.edges.resize(csr.edges.size());
+  for (index_t idx = 0; idx < dim; ++idx) {
+    auto edges = permuted.edges.begin() + permuted.offsets[new_index[idx]];
+    auto end = std::transform(csr[idx].begin(), csr[idx].end(), edges,
+                              [&](index_t to) { return new_index[to]; });
+    std::sort(edges, end);
+  }
+  return permuted;
+}
+
+// the map with all its indices idx replaced by new_index[idx], without the
+// keys with new_index[idx] == NO_INDEX
+template <typename Key, typename Hash>
+void remap_indices(std::unordered_map<Key, index_t, Hash> &map,
+                   const std::vector<index_t> &new_index) {
+  for (auto &entry : map)
+    entry.second = new_index[entry.second];
+  std::erase_if(map,
+                [](const auto &entry) { return entry.second == NO_INDEX; });
+}
+
+// a lookup in an unordered_map compares the keys of a bucket in turn
+template <typename Key, typename Hash>
+map_stats_t index_map_stats(const std::unordered_map<Key, index_t, Hash> &map) {
+  map_stats_t stats;
+  stats.load_factor = map.load_factor();
+  std::size_t probes = 0;
+  for (std::size_t b = 0; b < map.bucket_count(); ++b) {
+    std::size_t n = map.bucket_size(b);
+    probes += n * (n + 1) / 2;
+    stats.max_probe = std::max(stats.max_probe, n);
+  }
+  stats.mean_probe = map.empty() ? 0 : double(probes) / map.size();
+  return stats;
+}
+
+// The best score of a node from the scores of its children: the maximum of
+// -score + sign(score), where a 0 stays 0, or VALUE_NONE without children. The
+// sign is added branchlessly, and the maximum starts below all mate scores.
+// With AVX2 the children are relaxed eight at a time: the 16 bit scores are
+// fetched by 32 bit gathers and sign-extended, so a gather that includes the
+// last score (and would read past its end) is done by the scalar loop.
+inline score_t relax_children(const uninit_vector_t<score_t> &scores,
+                              std::span<const index_t> children) {
+  if (children.empty())
+    return VALUE_NONE;
+  int best_score = -VALUE_MATE - 1;
+  std::size_t i = 0;
+#ifdef __AVX2__
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i last = _mm256_set1_epi32(int(scores.size() - 1));
+  __m256i best = _mm256_set1_epi32(best_score);
+  for (; i + 8 <= children.size(); i += 8) {
+    __m256i idx = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(children.data() + i));
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(idx, last)))
+      break;
+    __m256i score = _mm256_i32gather_epi32(
+        reinterpret_cast<const int *>(scores.data()), idx, 2);
+    score = _mm256_srai_epi32(_mm256_slli_epi32(score, 16), 16);
+    __m256i relaxed = _mm256_add_epi32(
+        _mm256_sub_epi32(_mm256_cmpgt_epi32(zero, score),
+                         _mm256_cmpgt_epi32(score, zero)),
+        _mm256_sub_epi32(zero, score));
+    best = _mm256_max_epi32(best, relaxed);
+  }
+  __m128i best4 = _mm_max_epi32(_mm256_castsi256_si128(best),
+                                _mm256_extracti128_si256(best, 1));
+  best4 = _mm_max_epi32(best4, _mm_shuffle_epi32(best4, 0x4e));
+  best4 = _mm_max_epi32(best4, _mm_shuffle_epi32(best4, 0xb1));
+  best_score = _mm_cvtsi128_si32(best4);
+#endif
+  for (; i < children.size(); ++i) {
+    int score = scores[children[i]];
+    best_score = std::max(best_score, -score + (score > 0) - (score < 0));
+  }
+  return best_score;
+}
+
+// a child position spawned from the node parent of the game tree
+struct child_t {
+  PackedBoard pfen;
+  index_t parent;
+};
+
+// a node of the game tree that still needs to be expanded
+struct node_t {
+  PackedBoard pfen;
+  index_t idx;
+};
+
+// the (reduced) game tree: idx -> score, and the children and parents of idx
+struct tb_t {
+  uninit_vector_t<score_t> scores;
+  csr_t children, parents;
+
+  std::size_t size() const { return scores.size(); }
+};
+
+// the work done in the phases of create_tb(), and their wall times
+struct tb_stats_t {
+  std::size_t positions = 0, edges = 0; // of the game tree
+  int iterations = 0; // of generate_tb(), or plies of generate_tb_by_levels()
+  std::size_t updates = 0; // scores computed, or resolved by levels
+  double tree_seconds = 0, connect_seconds = 0, generate_seconds = 0;
+};
+
+// the opening book: the unique moves of the mating side in the positions of
+// the --openingMoves lines
+struct opening_book_t {
+  book_t fens; // FEN -> UCI move, to detect conflicts and for printing
+  std::unordered_map<PackedBoard, Move, PackedBoardHash> moves;
+  int max_ply = -1; // no book positions are deeper in the lines
+
+  bool empty() const { return moves.empty(); }
+  std::size_t size() const { return moves.size(); }
+
+  // the book move for pfen, or Move::NO_MOVE. A book position is in the tree
+  // at most at its ply in the lines, so deeper nodes skip the lookup.
+  Move find(const PackedBoard &pfen, int depth) const {
+    if (depth > max_ply)
+      return Move::NO_MOVE;
+    auto it = moves.find(pfen);
+    return it != moves.end() ? it->second : Move(Move::NO_MOVE);
+  }
+};
 
 inline score_t score2mate(score_t score) {
   if (score > 0)
@@ -39,14 +290,15 @@ inline score_t score2mate(score_t score) {
 
 inline void prepare_opening_book(std::string root_pos, Color mating_side,
                                  const std::string &openingMoves, int verbose,
-                                 book_t &openingBook) {
+                                 opening_book_t &openingBook,
+                                 std::ostream &out) {
   std::vector<std::vector<std::string>> lines;
   std::string line;
   std::istringstream iss(openingMoves);
   while (std::getline(iss, line, ',')) {
     int star = std::count(line.begin(), line.end(), '*');
     if (star > 1) {
-      std::cout << "More than one '*' in line " << line << "." << std::endl;
+      out << "More than one '*' in line " << line << "." << std::endl;
       std::exit(1);
     }
     std::string before_star(line), after_star;
@@ -93,21 +345,22 @@ inline void prepare_opening_book(std::string root_pos, Color mating_side,
   for (const auto &moves : lines) {
     if (verbose >= 3) {
       auto pv_str = join(moves.begin(), moves.end());
-      std::cout << "Processing line " << pv_str << " ..." << std::endl;
+      out << "Processing line " << pv_str << " ..." << std::endl;
       if (verbose >= 4)
-        std::cout << cdb_link(root_pos, pv_str) << std::endl;
+        out << cdb_link(root_pos, pv_str) << std::endl;
     }
     Board board(root_pos);
-    for (const auto &move_str : moves) {
+    for (int ply = 0; ply < int(moves.size()); ++ply) {
+      const std::string &move_str = moves[ply];
+      auto &fens = openingBook.fens;
       if (board.sideToMove() == mating_side) {
         std::string fen = board.getFen(false);
-        if (openingBook.count(fen) && openingBook[fen] != move_str) {
-          std::cout << "Cannot specify both " << move_str << " and "
-                    << openingBook[fen] << " for position " << fen << "."
-                    << std::endl;
+        if (fens.count(fen) && fens[fen] != move_str) {
+          out << "Cannot specify both " << move_str << " and " << fens[fen]
+              << " for position " << fen << "." << std::endl;
           std::exit(1);
         } else
-          openingBook[fen] = move_str;
+          fens[fen] = move_str;
       }
       Movelist legal_moves;
       movegen::legalmoves(legal_moves, board);
@@ -115,149 +368,1191 @@ inline void prepare_opening_book(std::string root_pos, Color mating_side,
       if (std::find(legal_moves.begin(), legal_moves.end(), m) ==
           legal_moves.end()) {
         std::string fen = board.getFen(false);
-        std::cout << "Illegal move " << uci::moveToUci(m) << " in position "
-                  << fen << "." << std::endl;
+        out << "Illegal move " << uci::moveToUci(m) << " in position " << fen
+            << "." << std::endl;
         std::exit(1);
       }
+      if (board.sideToMove() == mating_side) {
+        openingBook.moves[Board::Compact::encode(board)] = m;
+        openingBook.max_ply = std::max(openingBook.max_ply, ply);
+      }
       board.makeMove<true>(m);
     }
   }
 }
 
+// a UCI move from the options, compiled once so that it can be compared
+// against a Move without calling uci::moveToUci() for every move
+struct uci_move_t {
+  Square from, to;
+  PieceType promotion; // NONE if not a promotion
+
+  bool operator==(const uci_move_t &) const = default;
+};
+
+// the UCI form of move, as uci::moveToUci() would print it
+inline uci_move_t uci_move(const Move &move) {
+  Square to = move.to();
+  if (move.typeOf() == Move::CASTLING)
+    to = Square(to > move.from() ? File::FILE_G : File::FILE_C,
+                move.from().rank());
+  return {move.from(), to,
+          move.typeOf() == Move::PROMOTION ? move.promotionType()
+                                           : PieceType(PieceType::NONE)};
+}
+
+inline bool is_square(std::string_view s) {
+  return s.size() == 2 && s[0] >= 'a' && s[0] <= 'h' && s[1] >= '1' &&
+         s[1] <= '8';
+}
+
+// drops the moves that uci::moveToUci() can never print, as they never match
+inline std::vector<uci_move_t> compile_uci_moves(const std::string &moves) {
+  std::vector<uci_move_t> compiled;
+  for (const std::string &s : split(moves)) {
+    if ((s.size() != 4 && s.size() != 5) || !is_square(s.substr(0, 2)) ||
+        !is_square(s.substr(2, 2)) ||
+        (s.size() == 5 && std::string("nbrq").find(s[4]) == std::string::npos))
+      continue;
+    compiled.push_back({Square(s.substr(0, 2)), Square(s.substr(2, 2)),
+                        s.size() == 5 ? PieceType(s.substr(4, 1))
+                                      : PieceType(PieceType::NONE)});
+  }
+  return compiled;
+}
+
+// a SAN move from the options, compiled to the piece type, the destination and
+// the promotion, which determine all the moves it can stand for in a position
+struct san_move_t {
+  std::string san;
+  PieceType piece, promotion;
+  Square to;
+  int castling; // 0, or 1 for O-O and 2 for O-O-O
+
+  // only moves that pass this cheap test need to be printed with
+  // uci::moveToSan() to see if they match exactly
+  bool may_match(const Board &board, const Move &move) const {
+    if (move.typeOf() == Move::CASTLING)
+      return castling == (move.to() > move.from() ? 1 : 2);
+    return !castling && move.to() == to &&
+           board.at(move.from()).type() == piece &&
+           (move.typeOf() == Move::PROMOTION ? move.promotionType()
+                                             : PieceType(PieceType::NONE)) ==
+               promotion;
+  }
+};
+
+// drops the moves that uci::moveToSan() can never print, as they never match
+inline std::vector<san_move_t> compile_san_moves(const std::string &moves) {
+  std::vector<san_move_t> compiled;
+  for (const std::string &san : split(moves)) {
+    std::string_view s(san);
+    if (!s.empty() && (s.back() == '+' || s.back() == '#'))
+      s.remove_suffix(1);
+    // uci::moveToSan() prints castling moves without + or #
+    if (s == "O-O" || s == "O-O-O") {
+      compiled.push_back({std::string(s), PieceType::KING, PieceType::NONE,
+                          Square(), s == "O-O" ? 1 : 2});
+      continue;
+    }
+    PieceType promotion = PieceType::NONE;
+    if (s.size() >= 2 && s[s.size() - 2] == '=') {
+      promotion = PieceType(s.substr(s.size() - 1));
+      s.remove_suffix(2);
+    }
+    if (s.size() < 2 || !is_square(s.substr(s.size() - 2)))
+      continue;
+    PieceType piece = std::string_view("NBRQK").find(s[0]) != s.npos
+                          ? PieceType(s.substr(0, 1))
+                          : PieceType(PieceType::PAWN);
+    compiled.push_back(
+        {san, piece, promotion, Square(s.substr(s.size() - 2)), 0});
+  }
+  return compiled;
+}
+
+inline bool matches_san(const Board &board, const Move &move,
+                        const std::vector<san_move_t> &sans) {
+  for (const auto &san : sans)
+    if (san.may_match(board, move) && uci::moveToSan(board, move) == san.san)
+      return true;
+  return false;
+}
+
+// a mask with a bit for each piece type named in the string pieces
+inline unsigned piece_type_mask(const std::string &pieces) {
+  unsigned mask = 0;
+  for (char c : std::string_view("pnbrqk"))
+    if (pieces.find(c) != std::string::npos)
+      mask |= 1u << int(PieceType(std::string_view(&c, 1)));
+  return mask;
+}
+
+// the pieces of color in occ that attack sq, if the board had occupancy occ
+inline Bitboard attackers_with(const Board &board, Color color, Square sq,
+                               Bitboard occ) {
+  Bitboard queens = board.pieces(PieceType::QUEEN, color);
+  Bitboard atks =
+      attacks::pawn(~color, sq) & board.pieces(PieceType::PAWN, color);
+  atks |= attacks::knight(sq) & board.pieces(PieceType::KNIGHT, color);
+  atks |= attacks::bishop(sq, occ) &
+          (board.pieces(PieceType::BISHOP, color) | queens);
+  atks |=
+      attacks::rook(sq, occ) & (board.pieces(PieceType::ROOK, color) | queens);
+  atks |= attacks::king(sq) & board.pieces(PieceType::KING, color);
+  return atks & occ;
+}
+
+// whether the side to move has a legal capture onto one of the squares in
+// targets, or with en_passant also a legal en passant capture. This is decided
+// from the attacks, checks and pins, with an early exit, instead of generating
+// all the legal moves.
+inline bool has_legal_capture(const Board &board, Bitboard targets,
+                              bool en_passant) {
+  Color us = board.sideToMove(), them = ~us;
+  Square ksq = board.kingSq(us);
+  Bitboard occ = board.occ(), kbb = Bitboard::fromSquare(ksq);
+  targets &= board.us(them);
+  // the king can capture pieces that are not defended, also by a slider that
+  // is behind the king
+  for (Bitboard bb = attacks::king(ksq) & targets; bb;)
+    if (!attackers_with(board, them, bb.pop(), occ ^ kbb))
+      return true;
+  Bitboard checkers = attackers_with(board, them, ksq, occ);
+  if (checkers.count() < 2) {
+    // in check, only the checker can be captured by the other pieces
+    if (checkers)
+      targets &= checkers;
+    Bitboard ours = board.us(us) ^ kbb, pinned;
+    Bitboard rooks = board.pieces(PieceType::ROOK, them) |
+                     board.pieces(PieceType::QUEEN, them);
+    Bitboard bishops = board.pieces(PieceType::BISHOP, them) |
+                       board.pieces(PieceType::QUEEN, them);
+    // a pinned piece can only capture its pinner
+    auto find_pins = [&](Bitboard snipers, auto &&slider_attacks) {
+      while (snipers) {
+        Square sniper = snipers.pop();
+        Bitboard blockers = slider_attacks(ksq, Bitboard::fromSquare(sniper)) &
+                            slider_attacks(sniper, kbb) & occ;
+        if (blockers.count() != 1 || !(blockers & ours))
+          continue;
+        pinned |= blockers;
+        if ((targets & Bitboard::fromSquare(sniper)) &&
+            (attackers_with(board, us, sniper, occ) & blockers))
+          return true;
+      }
+      return false;
+    };
+    if (find_pins(attacks::rook(ksq, board.us(them)) & rooks,
+                  [](Square sq, Bitboard o) { return attacks::rook(sq, o); }) ||
+        find_pins(attacks::bishop(ksq, board.us(them)) & bishops,
+                  [](Square sq, Bitboard o) { return attacks::bishop(sq, o); }))
+      return true;
+    for (Bitboard bb = targets; bb;)
+      if (attackers_with(board, us, bb.pop(), occ) & ours & ~pinned)
+        return true;
+  }
+  Square ep = board.enpassantSq();
+  if (en_passant && ep != Square::underlying::NO_SQ)
+    for (Bitboard bb = attacks::pawn(them, ep) &
+                       board.pieces(PieceType::PAWN, us);
+         bb;) {
+      Square from = bb.pop();
+      Bitboard captured = Bitboard::fromSquare(Square(ep.file(), from.rank()));
+      Bitboard occ_after = (occ ^ Bitboard::fromSquare(from) ^ captured) |
+                           Bitboard::fromSquare(ep);
+      if (!attackers_with(board, them, ksq, occ_after))
+        return true;
+    }
+  return false;
+}
+
+// Encodes the children of a position directly from its PackedBoard, with the
+// same result as makeMove<true>(), Board::Compact::encode() and unmakeMove().
+// The nibbles of the parent are unpacked once, and for each move only the
+// moved pieces, the castling rights and the side to move are updated before
+// they are packed again. Double pushes that may allow en passant are left to
+// the Board, which decides if the capture would be legal.
+class ChildEncoder {
+public:
+  ChildEncoder(Board &board, const PackedBoard &pfen) : board_(board) {
+    for (int i = 0; i < 8; ++i)
+      occ_ = occ_ << 8 | pfen[i];
+    int offset = 16;
+    for (std::uint64_t bb = occ_; bb; bb &= bb - 1, ++offset) {
+      int sq = std::countr_zero(bb);
+      std::uint8_t nibble =
+          (pfen[offset / 2] >> (offset % 2 == 0 ? 4 : 0)) & 0xF;
+      // keep the castling rights with the rooks, but drop the en passant
+      // square and the side to move, which are set again for each child
+      if (nibble == EP_PAWN)
+        nibble = sq / 8 == 3 ? nibble_of(Piece::WHITEPAWN)
+                             : nibble_of(Piece::BLACKPAWN);
+      else if (nibble == BLACK_KING_TO_MOVE)
+        nibble = nibble_of(Piece::BLACKKING);
+      nibbles_[sq] = nibble;
+    }
+  }
+
+  PackedBoard operator()(const Move &move) {
+    Color stm = board_.sideToMove();
+    Square from = move.from(), to = move.to();
+    if (board_.at(from).type() == PieceType::PAWN &&
+        Square::value_distance(to, from) == 16 &&
+        (attacks::pawn(stm, to.ep_square()) &
+         board_.pieces(PieceType::PAWN, ~stm))) {
+      board_.makeMove<true>(move);
+      PackedBoard packed = Board::Compact::encode(board_);
+      board_.unmakeMove(move);
+      return packed;
+    }
+    auto nibbles = nibbles_;
+    std::uint64_t occ = occ_ & ~bit(from) & ~bit(to);
+    std::uint8_t moved = nibbles[from.index()];
+    std::uint8_t rook = nibble_of(Piece(PieceType::ROOK, stm));
+    std::uint8_t rook_with_rights =
+        stm == Color::WHITE ? WHITE_ROOK_CASTLING : BLACK_ROOK_CASTLING;
+    if (move.typeOf() == Move::CASTLING) {
+      bool king_side = to > from;
+      Square king_to = Square::castling_king_square(king_side, stm);
+      Square rook_to = Square::castling_rook_square(king_side, stm);
+      occ |= bit(king_to) | bit(rook_to);
+      nibbles[king_to.index()] = moved;
+      nibbles[rook_to.index()] = rook;
+    } else {
+      if (move.typeOf() == Move::ENPASSANT)
+        occ &= ~bit(Square(to.file(), from.rank()));
+      occ |= bit(to);
+      nibbles[to.index()] =
+          move.typeOf() == Move::PROMOTION
+              ? nibble_of(Piece(move.promotionType(), stm))
+          : moved == rook_with_rights ? rook
+                                      : moved;
+    }
+    // a king move loses all the castling rights of its side
+    if (moved == nibble_of(Piece(PieceType::KING, stm)))
+      for (std::uint64_t bb = occ; bb; bb &= bb - 1)
+        if (nibbles[std::countr_zero(bb)] == rook_with_rights)
+          nibbles[std::countr_zero(bb)] = rook;
+    if (stm == Color::WHITE)
+      nibbles[board_.kingSq(Color::BLACK).index()] = BLACK_KING_TO_MOVE;
+    PackedBoard packed{};
+    for (int i = 0; i < 8; ++i)
+      packed[i] = occ >> (56 - 8 * i);
+    int offset = 16;
+    for (; occ; occ &= occ - 1, ++offset)
+      packed[offset / 2] |= nibbles[std::countr_zero(occ)]
+                            << (offset % 2 == 0 ? 4 : 0);
+    return packed;
+  }
+
+private:
+  // the special nibbles of Board::Compact
+  static constexpr std::uint8_t EP_PAWN = 12, WHITE_ROOK_CASTLING = 13,
+                                BLACK_ROOK_CASTLING = 14,
+                                BLACK_KING_TO_MOVE = 15;
+
+  static std::uint8_t nibble_of(Piece piece) { return int(piece.internal()); }
+  static std::uint64_t bit(Square sq) { return 1ull << sq.index(); }
+
+  Board &board_;
+  std::uint64_t occ_ = 0;
+  std::array<std::uint8_t, 64> nibbles_{};
+};
+
+// The symmetries of the board that the keys of a TB may be reduced by. The
+// transformation t of the squares mirrors the files if t & 1, the ranks if
+// t & 2, and then swaps the files and the ranks if t & 4. Only the mirror of
+// the files keeps the moves of the pawns, so the others apply only to
+// positions without pawns, and positions with castling rights are never
+// transformed. The TB uses the transformations of mask for which the excludes
+// and the opening book are invariant.
+class Symmetries {
+public:
+  explicit Symmetries(unsigned mask = 0) : mask_(mask) {}
+
+  unsigned mask() const { return mask_; }
+
+  static Square transform(Square sq, int t) {
+    int file = sq.index() % 8, rank = sq.index() / 8;
+    if (t & 1)
+      file = 7 - file;
+    if (t & 2)
+      rank = 7 - rank;
+    if (t & 4)
+      std::swap(file, rank);
+    return Square(rank * 8 + file);
+  }
+  static Bitboard transform(Bitboard bb, int t) {
+    Bitboard transformed;
+    for (std::uint64_t b = bb.getBits(); b; b &= b - 1)
+      transformed |=
+          Bitboard::fromSquare(transform(Square(std::countr_zero(b)), t));
+    return transformed;
+  }
+  static uci_move_t transform(const uci_move_t &move, int t) {
+    return {transform(move.from, t), transform(move.to, t), move.promotion};
+  }
+
+  // the transformations of mask that apply to pfen
+  static unsigned applicable(const PackedBoard &pfen, unsigned mask) {
+    std::uint64_t occ;
+    std::array<std::uint8_t, 32> nibbles;
+    return unpack(pfen, mask, occ, nibbles);
+  }
+
+  // the PackedBoard of the position transformed by t
+  static PackedBoard transform(const PackedBoard &pfen, int t) {
+    std::uint64_t occ;
+    std::array<std::uint8_t, 32> nibbles;
+    unpack(pfen, 0, occ, nibbles);
+    return pack(occ, nibbles, t);
+  }
+
+  // the smallest of the transformations of pfen, which stands for all of them
+  // in the TB
+  PackedBoard canonical(const PackedBoard &pfen) const {
+    if (!mask_)
+      return pfen;
+    std::uint64_t occ;
+    std::array<std::uint8_t, 32> nibbles;
+    unsigned transforms = unpack(pfen, mask_, occ, nibbles);
+    PackedBoard best = pfen;
+    for (int t = 1; transforms >> t; ++t)
+      if (transforms >> t & 1)
+        best = std::min(best, pack(occ, nibbles, t));
+    return best;
+  }
+
+private:
+  // the special nibbles of Board::Compact
+  static constexpr std::uint8_t EP_PAWN = 12, WHITE_ROOK_CASTLING = 13,
+                                BLACK_ROOK_CASTLING = 14;
+
+  static std::uint8_t nibble_of(Piece piece) { return int(piece.internal()); }
+
+  // Unpacks the occupancy of pfen and its nibbles in the order of the squares,
+  // and returns the transformations of mask that apply to it.
+  static unsigned unpack(const PackedBoard &pfen, unsigned mask,
+                         std::uint64_t &occ,
+                         std::array<std::uint8_t, 32> &nibbles) {
+    occ = 0;
+    for (int i = 0; i < 8; ++i)
+      occ = occ << 8 | pfen[i];
+    bool pawns = false, castling = false;
+    for (int i = 0, n = std::popcount(occ); i < n; ++i) {
+      int offset = 16 + i;
+      std::uint8_t nibble = pfen[offset / 2] >> (offset % 2 == 0 ? 4 : 0) & 0xF;
+      nibbles[i] = nibble;
+      castling |=
+          nibble == WHITE_ROOK_CASTLING || nibble == BLACK_ROOK_CASTLING;
+      pawns |= nibble == nibble_of(Piece::WHITEPAWN) ||
+               nibble == nibble_of(Piece::BLACKPAWN) || nibble == EP_PAWN;
+    }
+    return castling ? 0 : pawns ? mask & 1u << 1 : mask;
+  }
+
+  // packs the nibbles of the squares of occ for the transformed squares
+  static PackedBoard pack(std::uint64_t occ,
+                          const std::array<std::uint8_t, 32> &nibbles, int t) {
+    std::uint64_t transformed_occ = 0;
+    std::array<std::uint8_t, 64> board{};
+    for (int i = 0; occ; occ &= occ - 1, ++i) {
+      Square sq = transform(Square(std::countr_zero(occ)), t);
+      transformed_occ |= 1ull << sq.index();
+      board[sq.index()] = nibbles[i];
+    }
+    PackedBoard packed{};
+    for (int i = 0; i < 8; ++i)
+      packed[i] = transformed_occ >> (56 - 8 * i);
+    int offset = 16;
+    for (; transformed_occ; transformed_occ &= transformed_occ - 1, ++offset)
+      packed[offset / 2] |= board[std::countr_zero(transformed_occ)]
+                            << (offset % 2 == 0 ? 4 : 0);
+    return packed;
+  }
+
+  unsigned mask_;
+};
+
+// The groups of excludes that allowed_move() can be instantiated for, so that
+// the checks of the unused groups are compiled out.
+enum filter_set_t : unsigned {
+  FILTERS_MOVES = 1,    // --excludeMoves, --excludeSANs
+  FILTERS_SQUARES = 2,  // --restrictTo, --excludeFrom, --excludeTo
+  FILTERS_PIECES = 4,   // --excludeCaptures(Of), --excludePromotionTo
+  FILTERS_ATTACKED = 8, // --excludeToAttacked
+  FILTERS_REPLIES = 16, // the excludes that need to make the move
+  FILTERS_ALL = 31
+};
+
 template <typename T> class MateTbBase {
 protected:
+  using key_t = typename T::key_type;
+  // all the messages of the TB, so that TBs can run concurrently in a batch
+  std::ostream &out;
   T fen2index;
+  // with --keyMode zobrist-verified: a second, independent hash of the position
+  // of each idx, to detect collisions of the Zobrist keys
+  bool verify_keys;
+  std::vector<std::size_t> key_checks;
   tb_t tb;
-  book_t openingBook; // maps FENs to unique moves
+  std::unique_ptr<TbFile> tb_file; // replaces fen2index and tb if loaded
+  // the edges found while creating the tree in initialize_tb(), and the
+  // children that the BFS did not connect, which connect_children() looks up:
+  // the children reached with other moves, and all the children of the nodes
+  // at max_depth
+  std::vector<std::vector<edge_t>> edges;
+  std::vector<std::vector<child_t>> unconnected;
+  // With --checkpoint: the nodes at max_depth, whose children are only
+  // connected if they are in the tree. A run resumed with a larger --depth
+  // continues the BFS from them at depth deepen_from (which is -1 for a BFS
+  // from the root).
+  std::vector<node_t> frontier;
+  int deepen_from = -1;
+  opening_book_t openingBook;
   Color mating_side;
   bool mating_side_to_move;
-  std::string root_pos, excludeCapturesOf, excludePromotionTo;
-  std::vector<std::string> excludeSANs, excludeMoves, excludeAllowingMoves,
-      excludeAllowingSANs;
+  std::string epd_str, root_pos;
+  std::string tree_options; // the excludes, keyMode and symmetry of the tree
+  // the textual excludes, compiled in the constructor
+  std::vector<uci_move_t> excludeMoves, excludeAllowingMoves;
+  std::vector<san_move_t> excludeSANs, excludeAllowingSANs;
+  unsigned excludeCapturesOf, excludePromotionTo; // piece type masks
   Bitboard BBrestrictTo, BBexcludeFrom, BBexcludeTo, BBexcludeAllowingFrom,
       BBexcludeAllowingTo;
+  // the symmetries under which the positions are stored once in fen2index
+  Symmetries symmetries;
   bool excludeCaptures, excludeToAttacked, excludeToCapturable,
-      excludeAllowingCapture, needToGenerateResponses;
+      excludeAllowingCapture, needToGenerateResponses, needToListResponses;
   int max_depth, verbose;
+  bool reduce, renumber;
+  std::string solver, checkpoint_dir, resume_dir;
+  int checkpoint_every; // generate_tb() iterations between checkpoints
+  // initialize_tb() may stop early once the tree has more positions (0 means
+  // no limit)
+  std::size_t position_limit = 0;
+  tb_stats_t stats_;
+  bool collect_stats; // with --stats, also fills details
+  detailed_stats_t details;
+  // spawn_children_as() for the groups of filters in use, set by configure()
+  using spawn_children_t = void (MateTbBase::*)(
+      Board &, const PackedBoard &, index_t, const Movelist &, Move,
+      std::vector<child_t> &, std::vector<child_t> &, filter_stats_t *);
+  spawn_children_t spawn_children_ = &MateTbBase::spawn_children_as<>;
+
+  // counts a rejection by filter in stats (if given), and returns false
+  static bool reject(filter_stats_t *stats, filter_t filter) {
+    if (stats)
+      stats->rejected[filter]++;
+    return false;
+  }
+
+  // the first of the excludeAllowing* filters that reply m violates, or
+  // FILTER_COUNT
+  filter_t excluded_reply(Board &board, const Move &m) const {
+    if (BBexcludeAllowingFrom & Bitboard::fromSquare(m.from()))
+      return FILTER_EXCLUDE_ALLOWING_FROM;
+    if (BBexcludeAllowingTo & Bitboard::fromSquare(m.to()))
+      return FILTER_EXCLUDE_ALLOWING_TO;
+    if (!excludeAllowingMoves.empty() &&
+        std::find(excludeAllowingMoves.begin(), excludeAllowingMoves.end(),
+                  uci_move(m)) != excludeAllowingMoves.end())
+      return FILTER_EXCLUDE_ALLOWING_MOVES;
+    if (!excludeAllowingSANs.empty() &&
+        matches_san(board, m, excludeAllowingSANs))
+      return FILTER_EXCLUDE_ALLOWING_SANS;
+    return FILTER_COUNT;
+  }
 
-  bool allowed_move(Board &board, Move move) {
+  // With stats, counts the rejections of the mating side's moves by filter
+  // and times the generation of the replies. Only the groups of Filters are
+  // checked: the default checks all of them at runtime.
+  template <unsigned Filters = FILTERS_ALL>
+  bool allowed_move(Board &board, Move move, filter_stats_t *stats = nullptr) {
     // restrict the mating side's candidate moves, to reduce overall tree size
     if (board.sideToMove() != mating_side)
       return true;
-    std::string uci = uci::moveToUci(move);
-    if (std::find(excludeMoves.begin(), excludeMoves.end(), uci) !=
-        excludeMoves.end())
-      return false;
-    if (!excludeSANs.empty() &&
-        std::find(excludeSANs.begin(), excludeSANs.end(),
-                  uci::moveToSan(board, move)) != excludeSANs.end())
-      return false;
-    if (!BBrestrictTo.empty() &&
-        !(BBrestrictTo & Bitboard::fromSquare(move.to())))
-      return false;
-    if (BBexcludeFrom & Bitboard::fromSquare(move.from()))
-      return false;
-    if (BBexcludeTo & Bitboard::fromSquare(move.to()))
-      return false;
-    if (excludeCaptures) {
-      if (board.isCapture(move))
-        return false;
-    } else if (!excludeCapturesOf.empty()) {
-      if (board.isCapture(move) &&
-          excludeCapturesOf.find(tolower(board.at(move.to()))) !=
-              std::string::npos)
-        return false;
+    if (stats)
+      stats->checked++;
+    if constexpr (Filters & FILTERS_MOVES) {
+      if (!excludeMoves.empty() &&
+          std::find(excludeMoves.begin(), excludeMoves.end(),
+                    uci_move(move)) != excludeMoves.end())
+        return reject(stats, FILTER_EXCLUDE_MOVES);
+      if (!excludeSANs.empty() && matches_san(board, move, excludeSANs))
+        return reject(stats, FILTER_EXCLUDE_SANS);
     }
-    if (excludeToAttacked && board.isAttacked(move.to(), ~board.sideToMove()))
-      return false;
-    if (!excludePromotionTo.empty()) {
-      if (uci.length() == 5 &&
-          excludePromotionTo.find(tolower(uci[4])) != std::string::npos)
-        return false;
+    if constexpr (Filters & FILTERS_SQUARES) {
+      if (!BBrestrictTo.empty() &&
+          !(BBrestrictTo & Bitboard::fromSquare(move.to())))
+        return reject(stats, FILTER_RESTRICT_TO);
+      if (BBexcludeFrom & Bitboard::fromSquare(move.from()))
+        return reject(stats, FILTER_EXCLUDE_FROM);
+      if (BBexcludeTo & Bitboard::fromSquare(move.to()))
+        return reject(stats, FILTER_EXCLUDE_TO);
     }
-    if (needToGenerateResponses) {
-      board.makeMove(move);
-      Movelist legal_moves;
-      movegen::legalmoves(legal_moves, board);
-      for (const Move &m : legal_moves) {
-        if ((excludeToCapturable && board.isCapture(m) &&
-             m.to() == move.to()) ||
-            (excludeAllowingCapture && board.isCapture(m)) ||
-            (BBexcludeAllowingFrom & Bitboard::fromSquare(m.from())) ||
-            (BBexcludeAllowingTo & Bitboard::fromSquare(m.to())) ||
-            (std::find(excludeAllowingMoves.begin(), excludeAllowingMoves.end(),
-                       uci::moveToUci(m)) != excludeAllowingMoves.end()) ||
-            (std::find(excludeAllowingSANs.begin(), excludeAllowingSANs.end(),
-                       uci::moveToSan(board, m)) !=
-             excludeAllowingSANs.end())) {
+    if constexpr (Filters & FILTERS_PIECES) {
+      if (excludeCaptures) {
+        if (board.isCapture(move))
+          return reject(stats, FILTER_EXCLUDE_CAPTURES);
+      } else if (excludeCapturesOf) {
+        if (board.isCapture(move) &&
+            (excludeCapturesOf >> int(board.at(move.to()).type()) & 1))
+          return reject(stats, FILTER_EXCLUDE_CAPTURES_OF);
+      }
+    }
+    if constexpr (Filters & FILTERS_ATTACKED)
+      if (excludeToAttacked &&
+          board.isAttacked(move.to(), ~board.sideToMove()))
+        return reject(stats, FILTER_EXCLUDE_TO_ATTACKED);
+    if constexpr (Filters & FILTERS_PIECES)
+      if (excludePromotionTo && move.typeOf() == Move::PROMOTION &&
+          (excludePromotionTo >> int(move.promotionType()) & 1))
+        return reject(stats, FILTER_EXCLUDE_PROMOTION_TO);
+    if constexpr (Filters & FILTERS_REPLIES)
+      if (needToGenerateResponses) {
+        std::chrono::steady_clock::time_point tic;
+        if (stats)
+          tic = std::chrono::steady_clock::now();
+        board.makeMove(move);
+        filter_t rejected_by = FILTER_COUNT;
+        if (excludeToCapturable &&
+            has_legal_capture(board, Bitboard::fromSquare(move.to()), false))
+          rejected_by = FILTER_EXCLUDE_TO_CAPTURABLE;
+        else if (excludeAllowingCapture &&
+                 has_legal_capture(board, Bitboard(~0ull), true))
+          rejected_by = FILTER_EXCLUDE_ALLOWING_CAPTURE;
+        // the remaining excludes need the replies, unless none of the replies
+        // can start on a square of BBexcludeAllowingFrom
+        else if (needToListResponses &&
+                 (bool(BBexcludeAllowingTo) || !excludeAllowingMoves.empty() ||
+                  !excludeAllowingSANs.empty() ||
+                  (BBexcludeAllowingFrom & board.us(board.sideToMove())))) {
+          Movelist legal_moves;
+          movegen::legalmoves(legal_moves, board);
+          for (const Move &m : legal_moves)
+            if ((rejected_by = excluded_reply(board, m)) != FILTER_COUNT)
+              break;
+        }
+        board.unmakeMove(move);
+        if (stats) {
+          stats->replies++;
+          stats->reply_ns +=
+              std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - tic)
+                  .count();
+        }
+        if (rejected_by != FILTER_COUNT)
+          return reject(stats, rejected_by);
+      }
+    return true;
+  }
+
+  // the groups of filters that can reject a move with the current excludes
+  unsigned active_filters() const {
+    unsigned filters = 0;
+    if (!excludeMoves.empty() || !excludeSANs.empty())
+      filters |= FILTERS_MOVES;
+    if (BBrestrictTo || BBexcludeFrom || BBexcludeTo)
+      filters |= FILTERS_SQUARES;
+    if (excludeCaptures || excludeCapturesOf || excludePromotionTo)
+      filters |= FILTERS_PIECES;
+    if (excludeToAttacked)
+      filters |= FILTERS_ATTACKED;
+    if (needToGenerateResponses)
+      filters |= FILTERS_REPLIES;
+    return filters;
+  }
+
+  // Appends the children of node idx (board, encoded as pfen) reached with
+  // allowed moves to children, and all the other children to other_children.
+  // With a book move only that move is allowed.
+  template <unsigned Filters = FILTERS_ALL>
+  void spawn_children_as(Board &board, const PackedBoard &pfen, index_t idx,
+                         const Movelist &legal_moves, Move book_move,
+                         std::vector<child_t> &children,
+                         std::vector<child_t> &other_children,
+                         filter_stats_t *stats) {
+    ChildEncoder encode_child(board, pfen);
+    for (const Move &move : legal_moves) {
+      bool allowed = book_move == Move::NO_MOVE
+                         ? allowed_move<Filters>(board, move, stats)
+                         : move == book_move;
+      (allowed ? children : other_children)
+          .push_back({encode_child(move), idx});
+    }
+  }
+
+  // the instantiations of spawn_children_as() for all the groups of filters,
+  // indexed by active_filters()
+  template <std::size_t... Filters>
+  static constexpr auto spawn_children_table(std::index_sequence<Filters...>) {
+    return std::array<spawn_children_t, sizeof...(Filters)>{
+        &MateTbBase::spawn_children_as<Filters>...};
+  }
+
+  // spawn_children_as() with only the filters in use compiled in
+  void spawn_children(Board &board, const PackedBoard &pfen, index_t idx,
+                      const Movelist &legal_moves, Move book_move,
+                      std::vector<child_t> &children,
+                      std::vector<child_t> &other_children,
+                      filter_stats_t *stats) {
+    (this->*spawn_children_)(board, pfen, idx, legal_moves, book_move,
+                             children, other_children, stats);
+  }
+
+  // with --stats, records the memory at the end of phase
+  void record_memory(const std::string &phase) {
+    if (collect_stats)
+      details.memory.push_back(memory_stats_t::after(phase));
+  }
+
+  // whether initialize_tb() keeps the frontier
+  bool keep_frontier() const { return !checkpoint_dir.empty(); }
+
+  // records the check hash of the new node idx, growing key_checks if needed
+  // (so parallel phases need to resize it beforehand)
+  void set_key_check(index_t idx, const PackedBoard &pfen) {
+    if (!verify_keys)
+      return;
+    if (idx >= key_checks.size())
+      key_checks.resize(idx + 1);
+    key_checks[idx] = PackedBoardHash{}(pfen);
+  }
+
+  // stops if the key of pfen collides with the key of a different node idx
+  void check_key(index_t idx, const PackedBoard &pfen) const {
+    if (verify_keys && key_checks[idx] != PackedBoardHash{}(pfen)) {
+      out << "Zobrist key collision for "
+          << Board::Compact::decode(pfen).getFen(false)
+          << ", use --keyMode packed." << std::endl;
+      std::exit(1);
+    }
+  }
+
+  // the position that stands for pfen and its symmetric positions in the TB
+  PackedBoard canonical(const PackedBoard &pfen) const {
+    return symmetries.canonical(pfen);
+  }
+
+  // the index of pfen in fen2index (or in tb_file), or NO_INDEX
+  index_t find_index(const PackedBoard &position) const {
+    PackedBoard pfen = canonical(position);
+    if (tb_file)
+      return tb_file->find_index(position_key<key_t>(pfen));
+    auto it = fen2index.find(position_key<key_t>(pfen));
+    if (it == fen2index.end())
+      return NO_INDEX;
+    check_key(it->second, pfen);
+    return it->second;
+  }
+
+  // Appends all the children of node idx at max_depth to children, which are
+  // not expanded and only connected if they are in the tree.
+  void spawn_all_children(Board &board, const PackedBoard &pfen, index_t idx,
+                          const Movelist &legal_moves,
+                          std::vector<child_t> &children) {
+    ChildEncoder encode_child(board, pfen);
+    for (const Move &move : legal_moves)
+      children.push_back({encode_child(move), idx});
+  }
+
+  // appends the edges to the children [first, last) of unconnected that are in
+  // the tree to node_edges
+  void connect_unconnected(const child_t *first, const child_t *last,
+                           std::vector<edge_t> &node_edges) const {
+    for (; first != last; ++first) {
+      index_t idx = find_index(first->pfen);
+      if (idx != NO_INDEX)
+        node_edges.emplace_back(first->parent, idx);
+    }
+  }
+
+  // Spawns the children of the node at depth of a resumed tree again for
+  // connect_children(), which walks the levels before deepen_from along the
+  // allowed moves, from the root, so that it visits the nodes at their depths
+  // in the BFS. Appends the edges to all the children in the tree to
+  // node_edges, and the allowed children before deepen_from for which
+  // visit(idx) returns true to next_level. children and other_children are
+  // scratch space.
+  template <typename F>
+  void reconnect_resumed_node(const node_t &node, int depth, F &&visit,
+                              std::vector<node_t> &next_level,
+                              std::vector<edge_t> &node_edges,
+                              std::vector<child_t> &children,
+                              std::vector<child_t> &other_children) {
+    auto board = Board::Compact::decode(node.pfen);
+    Movelist legal_moves;
+    movegen::legalmoves(legal_moves, board);
+    children.clear();
+    other_children.clear();
+    spawn_children(board, node.pfen, node.idx, legal_moves,
+                   openingBook.find(node.pfen, depth), children,
+                   other_children, nullptr);
+    for (const auto &child : children) {
+      PackedBoard pfen = canonical(child.pfen);
+      index_t idx = find_index(pfen);
+      node_edges.emplace_back(child.parent, idx);
+      if (depth + 1 < deepen_from && visit(idx))
+        next_level.push_back({pfen, idx});
+    }
+    for (const auto &child : other_children) {
+      index_t idx = find_index(child.pfen);
+      if (idx != NO_INDEX)
+        node_edges.emplace_back(child.parent, idx);
+    }
+  }
+
+  std::size_t tb_size() const { return tb_file ? tb_file->size() : tb.size(); }
+  score_t score(index_t idx) const {
+    return tb_file ? tb_file->score(idx) : tb.scores[idx];
+  }
+
+  // calls f(board, idx) for all the positions in the tree
+  template <typename F> void for_each_position(F &&f) const {
+    if constexpr (std::is_same_v<key_t, PackedBoard>) {
+      if (tb_file) {
+        auto keys = tb_file->keys<PackedBoard>();
+        for (index_t idx = 0; idx < keys.size(); ++idx)
+          f(Board::Compact::decode(keys[idx]), idx);
+      } else
+        for (const auto &[pfen, idx] : fen2index)
+          f(Board::Compact::decode(pfen), idx);
+    } else {
+      // Zobrist keys cannot be decoded, so the positions are found again with
+      // a BFS from the root that only follows moves into the tree
+      std::vector<bool> visited(tb_size(), false);
+      std::queue<std::pair<PackedBoard, index_t>> q;
+      auto visit = [&](const PackedBoard &pfen) {
+        index_t idx = find_index(pfen);
+        if (idx != NO_INDEX && !visited[idx]) {
+          visited[idx] = true;
+          q.push({pfen, idx});
+        }
+      };
+      visit(Board::Compact::encode(root_pos));
+      for (; !q.empty(); q.pop()) {
+        auto board = Board::Compact::decode(q.front().first);
+        f(board, q.front().second);
+        Movelist legal_moves;
+        movegen::legalmoves(legal_moves, board);
+        for (const Move &move : legal_moves) {
+          board.makeMove<true>(move);
+          visit(Board::Compact::encode(board));
           board.unmakeMove(move);
-          return false;
         }
       }
-      board.unmakeMove(move);
     }
+  }
+
+  // the score of idx obtained from the scores of its children, or VALUE_NONE
+  // if idx has no children
+  score_t best_child_score(index_t idx) const {
+    return relax_children(tb.scores, tb.children[idx]);
+  }
+
+  // the scores of the nodes [begin, end) as compact scores, and back
+  template <typename C>
+  void compact_scores(uninit_vector_t<C> &compact, std::size_t begin,
+                      std::size_t end) const {
+    for (std::size_t idx = begin; idx < end; ++idx)
+      compact[idx] = compact_score<C>(tb.scores[idx]);
+  }
+  template <typename C>
+  void expand_scores(const uninit_vector_t<C> &compact, std::size_t begin,
+                     std::size_t end) {
+    for (std::size_t idx = begin; idx < end; ++idx)
+      tb.scores[idx] = expand_score(compact[idx]);
+  }
+
+  // the nodes with nonzero scores grouped by mate_ply(): the initial levels
+  // of generate_tb_by_levels()
+  std::vector<std::vector<index_t>> scored_levels() const {
+    std::vector<std::vector<index_t>> levels;
+    for (index_t idx = 0; idx < tb.size(); ++idx)
+      if (tb.scores[idx]) {
+        std::size_t ply = mate_ply(tb.scores[idx]);
+        if (levels.size() <= ply)
+          levels.resize(ply + 1);
+        levels[ply].push_back(idx);
+      }
+    return levels;
+  }
+
+  // Renumbers the nodes in BFS order from the root, where the children of each
+  // node are visited in the order of their keys. So the children of a node
+  // are mostly close together, and the indices no longer depend on the order
+  // in which the threads created the tree.
+  void renumber_tb() {
+    auto tic = std::chrono::high_resolution_clock::now();
+    std::size_t dim = tb.size();
+    std::vector<key_t> keys(dim);
+    for (const auto &[key, idx] : fen2index)
+      keys[idx] = key;
+    std::vector<index_t> new_index(dim, NO_INDEX), order, children;
+    order.reserve(dim);
+    auto visit = [&](index_t idx) {
+      if (new_index[idx] == NO_INDEX) {
+        new_index[idx] = order.size();
+        order.push_back(idx);
+      }
+    };
+    // the loop over all the nodes only matters for unreachable ones
+    for (index_t root = 0; root < dim; ++root) {
+      std::size_t i = order.size();
+      for (visit(root); i < order.size(); ++i) {
+        auto span = tb.children[order[i]];
+        children.assign(span.begin(), span.end());
+        std::sort(children.begin(), children.end(),
+                  [&](index_t a, index_t b) { return keys[a] < keys[b]; });
+        for (index_t child : children)
+          visit(child);
+      }
+    }
+    keys.clear();
+    keys.shrink_to_fit();
+    tb.children = permute_csr(tb.children, new_index);
+    tb.parents = reverse_csr(tb.children);
+    uninit_vector_t<score_t> scores(dim);
+    for (index_t idx = 0; idx < dim; ++idx)
+      scores[new_index[idx]] = tb.scores[idx];
+    tb.scores = std::move(scores);
+    if (!key_checks.empty()) {
+      std::vector<std::size_t> checks(key_checks.size());
+      for (index_t idx = 0; idx < dim; ++idx)
+        checks[new_index[idx]] = key_checks[idx];
+      key_checks = std::move(checks);
+    }
+    remap_indices(fen2index, new_index);
+    for (auto &node : frontier)
+      node.idx = new_index[node.idx];
+    auto toc = std::chrono::high_resolution_clock::now();
+    double duration =
+        std::chrono::duration_cast<std::chrono::milliseconds>(toc - tic)
+            .count() /
+        1000.0;
+    out << "Renumbered " << dim << " positions in BFS order in " << std::fixed
+        << std::setprecision(2) << duration << "s" << std::endl;
+  }
+
+  // Removes the nodes from which no path in the tree leads to a mate: both
+  // solvers leave their scores at 0. Their parents only need to keep one of
+  // them as a child that draws, so the first one is kept without its children
+  // and replaces all the others. The root is always kept, and the nodes keep
+  // their order.
+  void reduce_tb() {
+    auto tic = std::chrono::high_resolution_clock::now();
+    std::size_t dim = tb.size();
+    std::vector<bool> live(dim, false);
+    std::vector<index_t> stack;
+    auto reach = [&](index_t idx) {
+      if (!live[idx]) {
+        live[idx] = true;
+        stack.push_back(idx);
+      }
+    };
+    reach(0);
+    for (index_t idx = 0; idx < dim; ++idx)
+      if (tb.scores[idx])
+        reach(idx);
+    while (!stack.empty()) {
+      index_t idx = stack.back();
+      stack.pop_back();
+      for (index_t parent : tb.parents[idx])
+        reach(parent);
+    }
+    index_t draw = NO_INDEX;
+    for (index_t idx = 0; idx < dim && draw == NO_INDEX; ++idx)
+      if (live[idx])
+        for (index_t child : tb.children[idx])
+          if (!live[child]) {
+            draw = child;
+            break;
+          }
+    std::vector<index_t> new_index(dim, NO_INDEX);
+    std::size_t kept = 0;
+    for (index_t idx = 0; idx < dim; ++idx)
+      if (live[idx] || idx == draw)
+        new_index[idx] = kept++;
+    csr_t children;
+    children.offsets.assign(kept + 1, 0);
+    children.edges.reserve(tb.children.edges.size());
+    for (index_t idx = 0; idx < dim; ++idx) {
+      if (new_index[idx] == NO_INDEX)
+        continue;
+      if (live[idx]) { // draw keeps no children
+        bool draws = false;
+        for (index_t child : tb.children[idx])
+          if (live[child])
+            children.edges.push_back(new_index[child]);
+          else
+            draws = true;
+        if (draws)
+          children.edges.push_back(new_index[draw]);
+      }
+      children.offsets[new_index[idx] + 1] = children.edges.size();
+    }
+    tb.children = std::move(children);
+    tb.parents = reverse_csr(tb.children);
+    uninit_vector_t<score_t> scores(kept);
+    for (index_t idx = 0; idx < dim; ++idx)
+      if (new_index[idx] != NO_INDEX)
+        scores[new_index[idx]] = tb.scores[idx];
+    tb.scores = std::move(scores);
+    if (!key_checks.empty()) {
+      std::vector<std::size_t> checks(kept);
+      for (index_t idx = 0; idx < dim; ++idx)
+        if (new_index[idx] != NO_INDEX)
+          checks[new_index[idx]] = key_checks[idx];
+      key_checks = std::move(checks);
+    }
+    remap_indices(fen2index, new_index);
+    auto toc = std::chrono::high_resolution_clock::now();
+    double duration =
+        std::chrono::duration_cast<std::chrono::milliseconds>(toc - tic)
+            .count() /
+        1000.0;
+    out << "Reduced the game tree from " << dim << " to " << kept
+        << " positions that can reach a mate in " << std::fixed
+        << std::setprecision(2) << duration << "s" << std::endl;
+  }
+
+  // tree.bin: the game tree and the mate scores after connect_children(), with
+  // the EPD and the options it was created with, and frontier.bin: the depth
+  // of the tree and where its BFS stopped. The scores of an earlier tree in
+  // checkpoint_dir are removed.
+  void checkpoint_tree() {
+    if (checkpoint_dir.empty())
+      return;
+    write_checkpoint(checkpoint_dir, "frontier.bin", [&](std::ofstream &f) {
+      write_value(f, max_depth);
+      write_vector(f, frontier);
+    });
+    frontier = {};
+    std::filesystem::remove(checkpoint_dir + "/scores.bin");
+    // the entries are sorted by index, so that the file only depends on them
+    std::vector<std::pair<key_t, index_t>> entries(fen2index.begin(),
+                                                   fen2index.end());
+    std::sort(entries.begin(), entries.end(),
+              [](const auto &a, const auto &b) { return a.second < b.second; });
+    // the keys and the indices are written apart, the pairs may have padding
+    std::vector<key_t> keys;
+    std::vector<index_t> indices;
+    keys.reserve(entries.size());
+    indices.reserve(entries.size());
+    for (const auto &[key, idx] : entries) {
+      keys.push_back(key);
+      indices.push_back(idx);
+    }
+    entries = {};
+    write_checkpoint(checkpoint_dir, "tree.bin", [&](std::ofstream &f) {
+      write_string(f, epd_str);
+      write_string(f, tree_options);
+      write_vector(f, keys);
+      write_vector(f, indices);
+      write_vector(f, key_checks);
+      write_vector(f, tb.children.offsets);
+      write_vector(f, tb.children.edges);
+      write_vector(f, tb.scores);
+    });
+    out << "Saved the game tree to " << checkpoint_dir << "." << std::endl;
+  }
+
+  bool resume_tree() {
+    std::vector<key_t> keys;
+    std::vector<index_t> indices;
+    bool found = read_checkpoint(resume_dir, "tree.bin", [&](std::ifstream &f) {
+      // the header is checked first, the keys may be of another type
+      std::string epd, options;
+      read_string(f, epd);
+      read_string(f, options);
+      if (epd != epd_str || options != tree_options) {
+        out << "The checkpoint in " << resume_dir << " is for \"" << epd
+            << "\" with " << options << "." << std::endl;
+        std::exit(1);
+      }
+      read_vector(f, keys);
+      read_vector(f, indices);
+      read_vector(f, key_checks);
+      read_vector(f, tb.children.offsets);
+      read_vector(f, tb.children.edges);
+      read_vector(f, tb.scores);
+    });
+    if (!found)
+      return false;
+    if (keys.size() != indices.size()) {
+      out << "The keys in " << resume_dir << " do not match the indices."
+          << std::endl;
+      std::exit(1);
+    }
+    fen2index.reserve(keys.size());
+    for (std::size_t i = 0; i < keys.size(); ++i)
+      fen2index.emplace(keys[i], indices[i]);
+    tb.parents = reverse_csr(tb.children);
+    out << "Resumed the game tree with " << tb.size() << " positions from "
+        << resume_dir << "." << std::endl;
+    return true;
+  }
+
+  // If the resumed tree was created to a lower depth than max_depth, prepares
+  // initialize_tb() to continue its BFS: the nodes of the frontier are
+  // expanded again, and the edges of the other nodes are found again by
+  // connect_children(), so that only the frontier is saved.
+  bool resume_frontier() {
+    int depth = -1;
+    std::vector<node_t> nodes;
+    if (!read_checkpoint(resume_dir, "frontier.bin", [&](std::ifstream &f) {
+          read_value(f, depth);
+          read_vector(f, nodes);
+        }) ||
+        nodes.empty() || depth >= max_depth)
+      return false;
+    for (const auto &node : nodes)
+      if (node.idx >= tb.size()) {
+        out << "The frontier in " << resume_dir
+            << " does not match the game tree." << std::endl;
+        std::exit(1);
+      }
+    tb.children = {};
+    tb.parents = {};
+    edges.clear();
+    frontier = std::move(nodes);
+    deepen_from = depth;
+    out << "Deepen the game tree from depth " << depth << " to " << max_depth
+        << ", starting from " << frontier.size() << " positions." << std::endl;
     return true;
   }
 
+  // scores.bin: the scores during the TB generation, whether it has finished
+  // and the solver that computed them
+  void checkpoint_scores(bool generated) {
+    if (checkpoint_dir.empty())
+      return;
+    write_checkpoint(checkpoint_dir, "scores.bin", [&](std::ofstream &f) {
+      write_value(f, generated);
+      write_string(f, solver);
+      write_vector(f, tb.scores);
+    });
+  }
+
+  // called by the TB generation after each iteration (or ply)
+  bool checkpoint_due(int iteration) const {
+    return checkpoint_every && iteration % checkpoint_every == 0;
+  }
+  void checkpoint_iteration(int iteration) {
+    if (checkpoint_due(iteration))
+      checkpoint_scores(false);
+  }
+
+  // returns whether the scores are final, intermediate scores are continued
+  // with the solver that computed them
+  bool resume_scores() {
+    bool generated = false;
+    std::string scores_solver;
+    uninit_vector_t<score_t> scores;
+    if (!read_checkpoint(resume_dir, "scores.bin", [&](std::ifstream &f) {
+          read_value(f, generated);
+          read_string(f, scores_solver);
+          read_vector(f, scores);
+        }))
+      return false;
+    if (scores.size() != tb.size()) {
+      out << "The scores in " << resume_dir << " do not match the game tree."
+          << std::endl;
+      std::exit(1);
+    }
+    tb.scores = std::move(scores);
+    out << "Resumed the " << (generated ? "final" : "intermediate")
+        << " scores from " << resume_dir << "." << std::endl;
+    if (!generated && scores_solver != solver) {
+      out << "Continuing them with --solver " << scores_solver << "."
+          << std::endl;
+      solver = scores_solver;
+    }
+    return generated;
+  }
+
   virtual void initialize_tb() = 0;
   virtual void connect_children() = 0;
   virtual void generate_tb() = 0;
+  virtual void generate_tb_by_levels() = 0;
 
-  score_t probe_tb(const std::string &fen) {
-    auto it = fen2index.find(Board::Compact::encode(fen));
-    if (it != fen2index.end())
-      return tb[it->second].first;
-    return VALUE_NONE;
+  score_t probe_tb(const PackedBoard &pfen) const {
+    index_t idx = find_index(pfen);
+    return idx != NO_INDEX ? score(idx) : VALUE_NONE;
   }
 
-  std::vector<std::string> obtain_pv(Board board) {
-    if (board.isGameOver().second == GameResult::DRAW)
-      return {};
-    if (board.sideToMove() != mating_side && board.isHalfMoveDraw() &&
-        board.getHalfMoveDrawType().second == GameResult::DRAW)
-      return {"; draw by 50mr"};
-    std::vector<std::pair<score_t, Move>> moves;
+  // the score of a move to the child pfen from the point of view of its parent
+  score_t move_score(const PackedBoard &pfen) const {
+    score_t score = probe_tb(pfen);
+    if (score != VALUE_NONE && score != 0)
+      score = -score + (score > 0 ? 1 : -1);
+    return score;
+  }
+
+  // The best move of board and its score, where the children are probed by
+  // their encoding from ChildEncoder. Ties go to the first best move, and
+  // VALUE_NONE counts as the worst score. Gives Move::NO_MOVE without legal
+  // moves.
+  std::pair<Move, score_t> best_child(Board &board) const {
     Movelist legal_moves;
     movegen::legalmoves(legal_moves, board);
+    Move best_move = Move::NO_MOVE;
+    score_t best_score = VALUE_NONE;
+    if (legal_moves.empty())
+      return {best_move, best_score};
+    ChildEncoder encode_child(board, Board::Compact::encode(board));
     for (const Move &move : legal_moves) {
-      board.makeMove<true>(move);
-      score_t score = probe_tb(board.getFen(false));
-      if (score != VALUE_NONE && score != 0)
-        score = -score + (score > 0 ? 1 : -1);
-      moves.emplace_back(score, move);
-      board.unmakeMove(move);
-    }
-    if (moves.empty())
-      return {};
-    auto best_move_it = std::max_element(moves.begin(), moves.end(),
-                                         [](const auto &a, const auto &b) {
-                                           if (a.first == VALUE_NONE)
-                                             return true;
-                                           if (b.first == VALUE_NONE)
-                                             return false;
-                                           return a.first < b.first;
-                                         });
-    Move bestmove = best_move_it->second;
-    board.makeMove<true>(bestmove);
-    std::vector<std::string> next_pv = obtain_pv(board);
-    board.unmakeMove(bestmove);
+      score_t score = move_score(encode_child(move));
+      if (best_score == VALUE_NONE ||
+          (score != VALUE_NONE && score > best_score)) {
+        best_move = move;
+        best_score = score;
+      }
+    }
+    return {best_move, best_score};
+  }
 
+  // follows the best moves from board
+  std::vector<std::string> obtain_pv(Board board) const {
     std::vector<std::string> pv;
-    pv.push_back(uci::moveToUci(bestmove));
-    pv.insert(pv.end(), next_pv.begin(), next_pv.end());
+    while (board.isGameOver().second != GameResult::DRAW) {
+      if (board.sideToMove() != mating_side && board.isHalfMoveDraw() &&
+          board.getHalfMoveDrawType().second == GameResult::DRAW) {
+        pv.push_back("; draw by 50mr");
+        break;
+      }
+      Move best_move = best_child(board).first;
+      if (best_move == Move::NO_MOVE)
+        break;
+      pv.push_back(uci::moveToUci(best_move));
+      board.makeMove<true>(best_move);
+    }
     return pv;
   }
 
-public:
-  MateTbBase(const Options &options) {
+  // runs func(begin, end) for the lines of output(), overridden to run them
+  // on the thread pool of matetb_threaded
+  virtual void for_lines(std::size_t n,
+                         const std::function<void(std::size_t, std::size_t)>
+                             &func) {
+    func(0, n);
+  }
+
+  // sets up the TB generation for options, with the memory of the tables of
+  // a previous position (if any) kept for reuse
+  void configure(const Options &options) {
     std::vector<std::string> parts = split(options.epdStr);
     if (parts.size() < 4) {
-      std::cout << "EPD \"" << options.epdStr << "\" is too short."
-                << std::endl;
+      out << "EPD \"" << options.epdStr << "\" is too short." << std::endl;
       std::exit(1);
     }
     root_pos = join(parts.begin(), parts.begin() + 4);
+    epd_str = options.epdStr;
+    tree_options = options.tree_options();
     max_depth = options.depth;
+    verify_keys = options.keyMode == "zobrist-verified";
     mating_side = (parts[1] == "b" ? Color::BLACK : Color::WHITE);
     mating_side_to_move = true;
     for (size_t i = 4; i < parts.size() - 1; ++i)
@@ -266,134 +1561,351 @@ public:
         mating_side_to_move = false;
         break;
       }
-    std::cout << "Restrict moves for "
-              << (mating_side == Color::WHITE ? "WHITE" : "BLACK") << " side."
-              << std::endl;
-    excludeSANs = split(options.excludeSANs);
-    excludeMoves = split(options.excludeMoves);
-    for (const std::string &sq : split(options.restrictTo))
-      BBrestrictTo |= Bitboard::fromSquare(Square(sq));
-    for (const std::string &sq : split(options.excludeFrom))
-      BBexcludeFrom |= Bitboard::fromSquare(Square(sq));
-    for (const std::string &sq : split(options.excludeTo))
-      BBexcludeTo |= Bitboard::fromSquare(Square(sq));
+    out << "Restrict moves for "
+        << (mating_side == Color::WHITE ? "WHITE" : "BLACK") << " side."
+        << std::endl;
+    auto squares = [](const std::string &names) {
+      Bitboard bb;
+      for (const std::string &sq : split(names))
+        bb |= Bitboard::fromSquare(Square(sq));
+      return bb;
+    };
+    excludeSANs = compile_san_moves(options.excludeSANs);
+    excludeMoves = compile_uci_moves(options.excludeMoves);
+    BBrestrictTo = squares(options.restrictTo);
+    BBexcludeFrom = squares(options.excludeFrom);
+    BBexcludeTo = squares(options.excludeTo);
     excludeCaptures = options.excludeCaptures;
-    excludeCapturesOf = options.excludeCapturesOf;
+    excludeCapturesOf = piece_type_mask(options.excludeCapturesOf);
     excludeToAttacked = options.excludeToAttacked;
     excludeToCapturable = options.excludeToCapturable;
-    excludePromotionTo = options.excludePromotionTo;
+    excludePromotionTo = piece_type_mask(options.excludePromotionTo);
     excludeAllowingCapture = options.excludeAllowingCapture;
-    for (const std::string &sq : split(options.excludeAllowingFrom))
-      BBexcludeAllowingFrom |= Bitboard::fromSquare(Square(sq));
-    for (const std::string &sq : split(options.excludeAllowingTo))
-      BBexcludeAllowingTo |= Bitboard::fromSquare(Square(sq));
-    excludeAllowingMoves = split(options.excludeAllowingMoves);
-    excludeAllowingSANs = split(options.excludeAllowingSANs);
-    needToGenerateResponses = excludeToCapturable || excludeAllowingCapture ||
-                              BBexcludeAllowingFrom || BBexcludeAllowingTo ||
-                              !excludeAllowingMoves.empty() ||
-                              !excludeAllowingSANs.empty();
+    BBexcludeAllowingFrom = squares(options.excludeAllowingFrom);
+    BBexcludeAllowingTo = squares(options.excludeAllowingTo);
+    excludeAllowingMoves = compile_uci_moves(options.excludeAllowingMoves);
+    excludeAllowingSANs = compile_san_moves(options.excludeAllowingSANs);
+    needToListResponses = BBexcludeAllowingFrom || BBexcludeAllowingTo ||
+                          !excludeAllowingMoves.empty() ||
+                          !excludeAllowingSANs.empty();
+    needToGenerateResponses =
+        excludeToCapturable || excludeAllowingCapture || needToListResponses;
+    spawn_children_ = spawn_children_table(
+        std::make_index_sequence<FILTERS_ALL + 1>())[active_filters()];
     verbose = options.verbose;
+    reduce = options.reduce;
+    renumber = options.renumber;
+    solver = options.solver;
+    checkpoint_dir = options.checkpoint;
+    resume_dir = options.resume;
+    checkpoint_every = options.checkpointEvery;
+    collect_stats = options.stats;
+    openingBook = {};
     if (!options.openingMoves.empty()) {
-      std::cout << "Preparing the opening book ..." << std::endl;
+      out << "Preparing the opening book ..." << std::endl;
       prepare_opening_book(root_pos, mating_side, options.openingMoves, verbose,
-                           openingBook);
-      std::cout << "Done. The opening book contains " << openingBook.size()
-                << " positions/moves." << std::endl;
+                           openingBook, out);
+      out << "Done. The opening book contains " << openingBook.size()
+          << " positions/moves." << std::endl;
       if (verbose >= 4) {
-        std::cout << "Opening book: ";
-        for (const auto &entry : openingBook)
-          std::cout << entry.first << ": " << entry.second << ", ";
-        std::cout << std::endl;
+        out << "Opening book: ";
+        for (const auto &entry : openingBook.fens)
+          out << entry.first << ": " << entry.second << ", ";
+        out << std::endl;
       }
     }
+    symmetries = Symmetries(options.symmetry == "auto" ? invariant_symmetries()
+                                                       : 0);
+    if (symmetries.mask())
+      out << "Store the symmetric positions once (for "
+          << std::popcount(symmetries.mask())
+          << " of the 7 symmetries of the board)." << std::endl;
   }
 
-  void create_tb() {
-    initialize_tb();
-    connect_children();
-    generate_tb();
+  // the transformations of Symmetries that map the excludes and the opening
+  // book onto themselves
+  unsigned invariant_symmetries() const {
+    // the SANs would have to be transformed with their disambiguations
+    if (!excludeSANs.empty() || !excludeAllowingSANs.empty())
+      return 0;
+    auto same_squares = [](Bitboard bb, int t) {
+      return Symmetries::transform(bb, t) == bb;
+    };
+    auto same_moves = [](const std::vector<uci_move_t> &moves, int t) {
+      return std::all_of(moves.begin(), moves.end(), [&](const auto &move) {
+        return std::find(moves.begin(), moves.end(),
+                         Symmetries::transform(move, t)) != moves.end();
+      });
+    };
+    auto same_book = [&](int t) {
+      for (const auto &[pfen, move] : openingBook.moves) {
+        if (!Symmetries::applicable(pfen, 1u << t))
+          continue;
+        auto it = openingBook.moves.find(Symmetries::transform(pfen, t));
+        if (it == openingBook.moves.end() ||
+            uci_move(it->second) != Symmetries::transform(uci_move(move), t))
+          return false;
+      }
+      return true;
+    };
+    unsigned mask = 0;
+    for (int t = 1; t < 8; ++t)
+      if (same_squares(BBrestrictTo, t) && same_squares(BBexcludeFrom, t) &&
+          same_squares(BBexcludeTo, t) &&
+          same_squares(BBexcludeAllowingFrom, t) &&
+          same_squares(BBexcludeAllowingTo, t) && same_moves(excludeMoves, t) &&
+          same_moves(excludeAllowingMoves, t) && same_book(t))
+        mask |= 1u << t;
+    return mask;
+  }
+
+public:
+  MateTbBase(const Options &options, std::ostream &output = std::cout)
+      : out(output) {
+    configure(options);
+  }
+
+  // starts over with the position of options, and keeps the memory of the
+  // hash table to reuse it (for batches of positions), while the memory of the
+  // TB is released, so that a large position does not hold it for all the
+  // smaller ones after it
+  void reset(const Options &options) {
+    fen2index.clear();
+    key_checks = {};
+    tb = {};
+    tb_file.reset();
+    edges = {};
+    unconnected = {};
+    frontier = {};
+    deepen_from = -1;
+    stats_ = {};
+    details = {};
+    configure(options);
+  }
+
+  // with a limit, create_tb() gives up once the game tree has more positions
+  void limit_positions(std::size_t limit) { position_limit = limit; }
+
+  std::size_t size() const {
+    return tb_file ? tb_file->size() : fen2index.size();
+  }
+
+  const tb_stats_t &stats() const { return stats_; }
+
+  // The probe interface for engines. Once the TB has been created (or loaded
+  // with load_tb()), any number of threads may probe it concurrently: the
+  // probes only read fen2index (or the mapped TB file) and the scores. The
+  // scores ignore the move counters and the repetitions of a game.
+
+  // the score of a position for its side to move, or VALUE_NONE if it is not
+  // in the TB, where score2mate() gives the signed distance to mate in moves
+  score_t probe(const PackedBoard &pfen) const { return probe_tb(pfen); }
+  score_t probe(const Board &board) const {
+    return probe_tb(Board::Compact::encode(board));
+  }
+
+  // the best move of board in the TB, or Move::NO_MOVE if none of its children
+  // is in the TB
+  Move best_move(const Board &board) const {
+    Board position = board;
+    auto [move, score] = best_child(position);
+    return score != VALUE_NONE ? move : Move(Move::NO_MOVE);
+  }
+
+  // a resumed run continues after the last phase found in resume_dir, and
+  // both solvers also continue from their intermediate scores: they are seeded
+  // from all the nonzero scores. A tree resumed with a larger --depth is
+  // deepened, and its scores are generated again from the mates: a deeper
+  // tree also gives the defending side new moves at the old frontier, so the
+  // old scores are no valid seeds. Returns false if the limit of
+  // limit_positions() was exceeded.
+  bool create_tb() {
+    bool resumed = !resume_dir.empty() && resume_tree();
+    bool deepened = resumed && resume_frontier();
+    if (!resumed || deepened) {
+      initialize_tb();
+      if (position_limit && fen2index.size() > position_limit)
+        return false;
+      record_memory("tree");
+      connect_children();
+      record_memory("connect");
+      if (reduce) {
+        reduce_tb();
+        record_memory("reduce");
+      }
+      if (renumber)
+        renumber_tb();
+      checkpoint_tree();
+    }
+    if (collect_stats)
+      details.map = index_map_stats(fen2index);
+    if (!resumed || deepened || !resume_scores()) {
+      if (solver == "levels")
+        generate_tb_by_levels();
+      else
+        generate_tb();
+      record_memory("generate");
+      checkpoint_scores(true);
+    }
+    if (collect_stats)
+      details.print(out, solver);
+    return true;
   }
 
-  void output() {
+  void load_tb(std::unique_ptr<TbFile> file) {
+    tb_file = std::move(file);
+    symmetries = Symmetries(tb_file->symmetries());
+    out << "Loaded TB with " << tb_file->size()
+        << " positions, generated with options " << tb_file->options()
+        << std::endl;
+  }
+
+  // prints the best line (and with --verbose all the lines), and returns the
+  // score and the PV of the best line
+  std::pair<score_t, std::string> output() {
     Board board(root_pos);
     std::vector<std::pair<score_t, std::vector<std::string>>> sp;
+    std::vector<std::pair<score_t, Move>> moves;
     Movelist legal_moves;
     movegen::legalmoves(legal_moves, board);
-    for (const Move &move : legal_moves) {
-      board.makeMove<true>(move);
-      score_t score = probe_tb(board.getFen(false));
-      if (score != VALUE_NONE && score != 0)
-        score = -score + (score > 0 ? 1 : -1);
-      std::vector<std::string> pv;
-      if (score != VALUE_NONE && score != 0) {
-        Board copy_board = board;
-        pv = obtain_pv(copy_board);
+    ChildEncoder encode_child(board, Board::Compact::encode(board));
+    for (const Move &move : legal_moves)
+      moves.emplace_back(move_score(encode_child(move)), move);
+    // the allowed children that --reduce removed draw, like the shared draw
+    // node that replaces them (a loaded TB does not know its excludes)
+    if (reduce && !tb_file) {
+      std::vector<child_t> children, other_children;
+      PackedBoard pfen = Board::Compact::encode(board);
+      spawn_children(board, pfen, 0, legal_moves, openingBook.find(pfen, 0),
+                     children, other_children, nullptr);
+      for (auto &[score, move] : moves) {
+        PackedBoard child_pfen = encode_child(move);
+        if (score == VALUE_NONE &&
+            std::any_of(children.begin(), children.end(),
+                        [&](const child_t &c) { return c.pfen == child_pfen; }))
+          score = 0;
       }
-      pv.insert(pv.begin(), uci::moveToUci(move));
-      sp.emplace_back(score, pv);
-      board.unmakeMove(move);
     }
-    std::sort(sp.begin(), sp.end(), [](const auto &a, const auto &b) {
+    auto better = [](const auto &a, const auto &b) {
       if (a.first == VALUE_NONE)
         return false;
       if (b.first == VALUE_NONE)
         return true;
       return a.first > b.first;
+    };
+    std::sort(moves.begin(), moves.end(), better);
+    // only the first line is shown without --verbose
+    sp.resize(verbose ? moves.size() : std::min<std::size_t>(1, moves.size()));
+    for_lines(sp.size(), [&](std::size_t begin, std::size_t end) {
+      for (std::size_t i = begin; i < end; ++i) {
+        auto [score, move] = moves[i];
+        std::vector<std::string> pv;
+        if (score != VALUE_NONE && score != 0) {
+          Board child = board;
+          child.makeMove<true>(move);
+          pv = obtain_pv(child);
+        }
+        pv.insert(pv.begin(), uci::moveToUci(move));
+        sp[i] = {score, std::move(pv)};
+      }
     });
     score_t score = sp[0].first;
     auto pv_str = join(sp[0].second.begin(), sp[0].second.end());
+    std::pair<score_t, std::string> best = {score, pv_str};
     if (score != VALUE_NONE && score != 0) {
-      std::cout << "\nMatetrack:" << std::endl;
-      std::cout << root_pos << " bm #" << score2mate(score)
-                << "; PV: " << pv_str << ";" << std::endl;
+      out << "\nMatetrack:" << std::endl;
+      out << root_pos << " bm #" << score2mate(score) << "; PV: " << pv_str
+          << ";" << std::endl;
     } else
-      std::cout << "No mate found." << std::endl;
+      out << "No mate found." << std::endl;
     if (verbose == 0)
-      return;
-    std::cout << "\nMultiPV:" << std::endl;
+      return best;
+    out << "\nMultiPV:" << std::endl;
     for (size_t count = 0; count < sp.size(); ++count) {
       score_t score = sp[count].first;
       if (score == VALUE_NONE || (score < 0 && mating_side_to_move)) {
-        std::cout << "multipv " << count + 1 << " score None" << std::endl;
+        out << "multipv " << count + 1 << " score None" << std::endl;
         continue;
       }
       std::string score_str = "cp " + std::to_string(score);
       pv_str = join(sp[count].second.begin(), sp[count].second.end());
       if (score != 0)
         score_str += " mate " + std::to_string(score2mate(score));
-      std::cout << "multipv " << count + 1 << " score " << score_str << " pv "
-                << pv_str << std::endl;
+      out << "multipv " << count + 1 << " score " << score_str << " pv "
+          << pv_str << std::endl;
       if (verbose >= 2) {
-        std::cout << cdb_link(root_pos, pv_str) << "\n";
+        out << cdb_link(root_pos, pv_str) << "\n";
         if (score != 0) {
           auto child_pv_str =
               join(sp[count].second.begin() + 1, sp[count].second.end());
-          std::cout << "Child FEN: ";
+          out << "Child FEN: ";
           auto move = uci::uciToMove(board, sp[count].second[0]);
           board.makeMove<true>(move);
-          std::cout << board.getFen(false) << " bm #"
-                    << score2mate(-score + (score < 0 ? 1 : -1))
-                    << "; PV: " << child_pv_str << ";\n";
+          out << board.getFen(false) << " bm #"
+              << score2mate(-score + (score < 0 ? 1 : -1)) << "; PV: "
+              << child_pv_str << ";\n";
           board.unmakeMove(move);
         }
-        std::cout << "\n";
+        out << "\n";
       }
     }
+    return best;
   }
 
+  // exports the TB as text, with one EPD line per position, where a stored
+  // position is listed with all its symmetric images
   void write_tb(const std::string &filename) {
     std::ofstream f(filename);
-    for (const auto &[pfen, idx] : fen2index) {
-      auto board = Board::Compact::decode(pfen);
-      std::string fen = board.getFen(false);
-      score_t s = tb[idx].first;
+    std::vector<PackedBoard> images;
+    for_each_position([&](const Board &board, index_t idx) {
+      score_t s = score(idx);
       std::string bmstr = (s == VALUE_NONE || s == 0)
                               ? ""
                               : " bm #" + std::to_string(score2mate(s)) + ";";
-      f << fen << bmstr << std::endl;
-    }
+      PackedBoard pfen = Board::Compact::encode(board);
+      unsigned transforms = Symmetries::applicable(pfen, symmetries.mask());
+      if (!transforms) {
+        f << board.getFen(false) << bmstr << '\n';
+        return;
+      }
+      images.assign(1, pfen);
+      for (int t = 1; transforms >> t; ++t)
+        if (transforms >> t & 1)
+          images.push_back(Symmetries::transform(pfen, t));
+      // a position may be its own image
+      std::sort(images.begin(), images.end());
+      images.erase(std::unique(images.begin(), images.end()), images.end());
+      for (const auto &image : images)
+        f << Board::Compact::decode(image).getFen(false) << bmstr << '\n';
+    });
     f.close();
-    std::cout << "Wrote TB to " << filename << "." << std::endl;
+    out << "Wrote TB to " << filename << "." << std::endl;
+  }
+
+  // saves the TB in the binary format of tb_file.hpp
+  void save_tb(const std::string &filename, const std::string &options) {
+    if (tb_file) {
+      std::vector<score_t> scores(tb_file->size());
+      for (std::size_t idx = 0; idx < scores.size(); ++idx)
+        scores[idx] = tb_file->score(idx);
+      write_tb_file(filename, tb_file->epd(), tb_file->options(),
+                    tb_file->symmetries(), tb_file->keys<key_t>(),
+                    std::span<const score_t>(scores));
+    } else {
+      std::vector<std::pair<key_t, index_t>> entries(fen2index.begin(),
+                                                     fen2index.end());
+      std::sort(entries.begin(), entries.end());
+      std::vector<key_t> keys;
+      std::vector<score_t> scores;
+      keys.reserve(entries.size());
+      scores.reserve(entries.size());
+      for (const auto &[key, idx] : entries) {
+        keys.push_back(key);
+        scores.push_back(tb.scores[idx]);
+      }
+      write_tb_file<key_t>(filename, epd_str, options, symmetries.mask(), keys,
+                           scores);
+    }
+    out << "Saved TB to " << filename << "." << std::endl;
   }
 };
@@ -0,0 +1,655 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "concurrent_map.hpp"
+#include "external/chess.hpp"
+#include "external/threadpool.hpp"
+#include "matetb.hpp"
+#include "spill.hpp"
+
+// concurrent hash map to map FENs from game tree to their index idx
+template <typename Key>
+using index_map_t = ConcurrentIndexMap<Key, key_hash_t<Key>>;
+
+template <typename Key> class MateTB : public MateTbBase<index_map_t<Key>> {
+  using Base = MateTbBase<index_map_t<Key>>;
+  using Base::best_child_score, Base::canonical, Base::check_key,
+      Base::checkpoint_due, Base::checkpoint_iteration, Base::checkpoint_scores,
+      Base::collect_stats, Base::compact_scores, Base::connect_unconnected,
+      Base::deepen_from, Base::details, Base::edges, Base::expand_scores,
+      Base::fen2index, Base::find_index, Base::frontier, Base::keep_frontier,
+      Base::key_checks, Base::max_depth, Base::openingBook, Base::out,
+      Base::position_limit, Base::reconnect_resumed_node, Base::root_pos,
+      Base::scored_levels, Base::set_key_check, Base::spawn_all_children,
+      Base::spawn_children, Base::stats_, Base::tb, Base::unconnected,
+      Base::verbose, Base::verify_keys;
+  score_t spawn_allowed_children(const PackedBoard &pfen, index_t idx,
+                                 int depth, std::vector<child_t> &children,
+                                 std::vector<child_t> &other_children,
+                                 filter_stats_t *filter_stats);
+  int concurrency;
+  ThreadPool &pool; // shared by all the phases of the TB generation
+  bool numa;
+  // with --memoryLimit: the BFS levels and the children for
+  // connect_children() are buffered in SpillBuffers, which each keep at most
+  // spill_bytes (a third of the limit) in memory
+  std::string spill_dir;
+  std::size_t spill_bytes;
+  // the entries of a SpillBuffer<T> in memory, or 0 without --memoryLimit
+  template <typename T> std::size_t spill_entries() const {
+    return spill_bytes ? std::max<std::size_t>(1, spill_bytes / sizeof(T))
+                       : 0;
+  }
+  std::vector<SpillBuffer<child_t>> spilled_children;
+  // initialize_tb() expands at most SLICE_NODES nodes before it inserts their
+  // children, and fen2index grows by at least MIN_INSERTS keys at a time
+  static constexpr std::size_t SLICE_NODES = 1 << 16, MIN_INSERTS = 1 << 16;
+  void initialize_tb();
+  void connect_children();
+  void connect_resumed();
+  void place_tb();
+  template <typename F> void for_nodes(std::vector<index_t> &nodes, F &&func);
+  void generate_tb();
+  void generate_tb_by_levels();
+  void for_lines(std::size_t n,
+                 const std::function<void(std::size_t, std::size_t)> &func)
+      override;
+  template <typename T>
+  int resolve_levels(std::vector<std::vector<index_t>> &levels, int ply,
+                     uninit_vector_t<std::uint8_t> &unresolved);
+
+public:
+  MateTB(const Options &options, ThreadPool &thread_pool,
+         std::ostream &output = std::cout)
+      : Base(options, output), concurrency(thread_pool.size()),
+        pool(thread_pool), numa(options.numa),
+        spill_dir(options.spillDir.empty()
+                      ? std::filesystem::temp_directory_path().string()
+                      : options.spillDir),
+        spill_bytes((options.memoryLimit << 20) / 3) {
+    fen2index.reserve(options.expectedPositions);
+  }
+};
+
+// Appends the children of pfen reached with allowed moves to children, and all
+// the other children to other_children, which at max_depth are all the
+// children. The rejected moves are counted in filter_stats, unless it is
+// nullptr.
+template <typename Key>
+score_t MateTB<Key>::spawn_allowed_children(
+    const PackedBoard &pfen, index_t idx, int depth,
+    std::vector<child_t> &children, std::vector<child_t> &other_children,
+    filter_stats_t *filter_stats) {
+  auto board = Board::Compact::decode(pfen);
+  Movelist legal_moves;
+  movegen::legalmoves(legal_moves, board);
+  score_t score = legal_moves.size() == 0 && board.inCheck() ? -VALUE_MATE : 0;
+  if (score)
+    return score;
+  if (depth >= max_depth) {
+    spawn_all_children(board, pfen, idx, legal_moves, other_children);
+    return score;
+  }
+  Move book_move = openingBook.find(pfen, depth);
+  if (verbose >= 3 && book_move != Move::NO_MOVE) {
+    out << "Picked move " << uci::moveToUci(book_move) << " for "
+        << board.getFen(false) << "." << std::endl;
+    if (verbose >= 4) {
+      out << "Remaining book: ";
+      for (const auto &entry : openingBook.fens)
+        out << entry.first << ": " << entry.second << ", ";
+      out << std::endl;
+    }
+  }
+  spawn_children(board, pfen, idx, legal_moves, book_move, children,
+                 other_children, filter_stats);
+  return score;
+}
+
+// the output of one thread in initialize_tb(), which is kept for all the
+// slices of a level so that the tasks append to it without locks or new
+// allocations
+struct thread_buffers_t {
+  std::vector<child_t> children;       // of the nodes of the slice
+  std::vector<child_t> other_children; // not connected by the BFS
+  std::vector<node_t> next_level;      // of the children of the slice
+  std::vector<edge_t> edges;
+  std::vector<std::pair<index_t, score_t>> mate_score;
+};
+
+// The tree is created level by level, in slices of at most SLICE_NODES nodes of
+// a level. The allowed children of a slice are first looked up in fen2index,
+// which gives the edges to the ones already in the tree, and only the others
+// are inserted together with their parent once the slice has been expanded.
+// Only the new positions go into the next level, so the levels hold no
+// transpositions. The children reached with other moves, and all the children
+// of the nodes at max_depth, are connected at once if they are in the tree, and
+// before the last level the others are left to connect_children() in
+// unconnected. Each thread writes into its own thread_buffers_t, and the
+// segments of the threads are concatenated once per slice. With --memoryLimit
+// the levels and the children for connect_children() are read back in chunks
+// from SpillBuffers. With --stats each thread counts the rejected moves in its
+// own filter_stats_t. A deepened tree continues with its frontier as the level
+// at deepen_from.
+template <typename Key> void MateTB<Key>::initialize_tb() {
+  auto tic = std::chrono::high_resolution_clock::now();
+  out << "Create the allowed part of the game tree ..." << std::endl;
+  SpillBuffer<node_t> current_level(spill_dir, spill_entries<node_t>());
+  SpillBuffer<child_t> spilled(spill_dir, spill_entries<child_t>());
+  std::vector<node_t> nodes;
+  std::vector<child_t> chunk;
+  std::vector<thread_buffers_t> buffers(pool.size());
+  int depth = std::max(deepen_from, 0);
+  std::atomic<size_t> count = fen2index.size();
+  std::size_t first_new = count; // the scores before it are kept
+  std::vector<filter_stats_t> filter_stats(collect_stats ? pool.size() : 0);
+  spilled_children.clear();
+  if (deepen_from < 0) {
+    edges.clear();
+    unconnected.clear();
+    PackedBoard root = canonical(Board::Compact::encode(root_pos));
+    fen2index.insert(position_key<Key>(root), [&]() {
+      set_key_check(0, root);
+      return count++;
+    });
+    current_level.append({{root, 0}});
+    if (collect_stats)
+      details.count_depth(0, 1, 0);
+  } else
+    current_level.append(std::exchange(frontier, {}));
+  // the limit of limit_positions() is checked after each part of the inserts
+  auto over_limit = [&]() {
+    return position_limit && count > position_limit;
+  };
+  for (; !current_level.empty() && depth <= max_depth && !over_limit();
+       depth++) {
+    auto level_tic = std::chrono::high_resolution_clock::now();
+    size_t level_size = current_level.size();
+    bool last_level = depth == max_depth;
+    std::atomic<size_t> children_size = 0;
+    SpillBuffer<node_t> next_level(spill_dir, spill_entries<node_t>());
+    // expands the nodes [begin, end) of nodes, and connects their allowed
+    // children that are already in the tree
+    auto expand_batch = [&](size_t begin, size_t end, size_t thread_id) {
+      auto &buffer = buffers[thread_id];
+      filter_stats_t *local_stats =
+          collect_stats ? &filter_stats[thread_id] : nullptr;
+      size_t batch_children = 0;
+      for (size_t i = begin; i < end; ++i) {
+        size_t first_child = buffer.children.size();
+        size_t first_other = buffer.other_children.size();
+        score_t score = spawn_allowed_children(
+            nodes[i].pfen, nodes[i].idx, depth, buffer.children,
+            buffer.other_children, local_stats);
+        if (score)
+          buffer.mate_score.push_back({nodes[i].idx, score});
+        // the other children already in the tree are connected at once, and
+        // after the last level no more positions are inserted
+        auto connected = std::remove_if(
+            buffer.other_children.begin() + first_other,
+            buffer.other_children.end(), [&](const child_t &child) {
+              index_t idx = find_index(child.pfen);
+              if (idx != NO_INDEX)
+                buffer.edges.emplace_back(child.parent, idx);
+              return idx != NO_INDEX || last_level;
+            });
+        buffer.other_children.erase(connected, buffer.other_children.end());
+        batch_children += buffer.children.size() - first_child;
+        auto known = std::remove_if(
+            buffer.children.begin() + first_child, buffer.children.end(),
+            [&](child_t &child) {
+              child.pfen = canonical(child.pfen);
+              index_t idx = fen2index.find_index(position_key<Key>(child.pfen));
+              if (idx == NO_INDEX)
+                return false;
+              check_key(idx, child.pfen);
+              buffer.edges.emplace_back(child.parent, idx);
+              return true;
+            });
+        buffer.children.erase(known, buffer.children.end());
+      }
+      children_size += batch_children;
+    };
+    // inserts the children [begin, end) of chunk into fen2index
+    auto insert_batch = [&](size_t begin, size_t end, size_t thread_id) {
+      auto &buffer = buffers[thread_id];
+      for (size_t i = begin; i < end; ++i) {
+        const PackedBoard &pfen = chunk[i].pfen;
+        size_t count_check = 0;
+        // the check hash is set before the new index is published
+        auto [idx, is_new_entry] =
+            fen2index.insert(position_key<Key>(pfen), [&]() {
+              count_check = count++;
+              set_key_check(count_check, pfen);
+              return count_check;
+            });
+        buffer.edges.emplace_back(chunk[i].parent, idx);
+        if (!is_new_entry) {
+          check_key(idx, pfen);
+          continue;
+        }
+        buffer.next_level.push_back({pfen, idx});
+        if (count_check % 10000 == 0) {
+          std::stringstream ss;
+          ss << "Progress: " << count_check << " (d" << depth + 1 << ")\r";
+          out << ss.str() << std::flush;
+        }
+      }
+    };
+    while (!over_limit() && current_level.read(nodes)) {
+      if (last_level && keep_frontier())
+        frontier.insert(frontier.end(), nodes.begin(), nodes.end());
+      for (size_t slice = 0; slice < nodes.size() && !over_limit();
+           slice += SLICE_NODES) {
+        size_t slice_size = std::min(nodes.size() - slice, SLICE_NODES);
+        pool.parallel_for(
+            slice_size, std::max(size_t(128), slice_size / (concurrency * 8)),
+            [&](size_t begin, size_t end, size_t thread_id) {
+              expand_batch(slice + begin, slice + end, thread_id);
+            });
+        chunk.clear();
+        for (auto &buffer : buffers) {
+          chunk.insert(chunk.end(), buffer.children.begin(),
+                       buffer.children.end());
+          buffer.children.clear();
+          if (spill_bytes) {
+            spilled.append(buffer.other_children);
+            buffer.other_children.clear();
+          }
+        }
+        // the same new position may still be reached from several nodes of
+        // the slice, so the chunk is inserted in parts that fit into the room
+        // of fen2index, which only grows once the part would be too small
+        for (size_t first = 0; first < chunk.size() && !over_limit();) {
+          size_t part = std::min(chunk.size() - first, fen2index.room());
+          if (part < std::min(chunk.size() - first, MIN_INSERTS)) {
+            fen2index.reserve(fen2index.size() +
+                              std::min(chunk.size() - first, MIN_INSERTS));
+            continue;
+          }
+          if (verify_keys)
+            key_checks.resize(count + part);
+          pool.parallel_for(part,
+                            std::max(size_t(128), part / (concurrency * 8)),
+                            [&](size_t begin, size_t end, size_t thread_id) {
+                              insert_batch(first + begin, first + end,
+                                           thread_id);
+                            });
+          first += part;
+        }
+        for (auto &buffer : buffers)
+          next_level.append(std::move(buffer.next_level));
+      }
+    }
+    if (collect_stats && depth < max_depth && children_size)
+      details.count_depth(depth + 1, next_level.size(),
+                          children_size - next_level.size());
+    if (verbose >= 1) {
+      auto level_toc = std::chrono::high_resolution_clock::now();
+      double level_duration =
+          std::chrono::duration_cast<std::chrono::milliseconds>(level_toc -
+                                                                level_tic)
+              .count() /
+          1000.0;
+      out << "Depth " << depth << ": " << level_size << " positions, "
+          << children_size << " allowed children, " << next_level.size()
+          << " new positions in " << std::fixed << std::setprecision(2)
+          << level_duration << "s" << std::endl;
+    }
+    current_level = std::move(next_level);
+    // the buffers of the slices are released, so that they only grow to the
+    // largest slice of each level
+    chunk = {};
+    for (auto &buffer : buffers)
+      buffer.children = {};
+  }
+  if (spill_bytes)
+    spilled_children.push_back(std::move(spilled));
+  if (verify_keys)
+    key_checks.resize(count);
+  std::vector<std::pair<index_t, score_t>> mate_score;
+  for (auto &buffer : buffers) {
+    if (!spill_bytes)
+      unconnected.push_back(std::move(buffer.other_children));
+    edges.push_back(std::move(buffer.edges));
+    mate_score.insert(mate_score.end(), buffer.mate_score.begin(),
+                      buffer.mate_score.end());
+  }
+  auto toc = std::chrono::high_resolution_clock::now();
+  double duration =
+      std::chrono::duration_cast<std::chrono::milliseconds>(toc - tic).count() /
+      1000.0;
+  for (const auto &local_stats : filter_stats)
+    details.filters += local_stats;
+  stats_.positions = count;
+  stats_.tree_seconds = std::chrono::duration<double>(toc - tic).count();
+  out << "Found " << count << " positions to depth " << depth - 1 << " in "
+      << std::fixed << std::setprecision(2) << duration << "s  " << std::endl;
+  out << "Seed the mate scores ...\r" << std::flush;
+  tb.scores.resize(count);
+  pool.static_for(count - first_new, [&](size_t begin, size_t end) {
+    std::fill(tb.scores.begin() + first_new + begin,
+              tb.scores.begin() + first_new + end, 0);
+  });
+  for (const auto &entry : mate_score)
+    tb.scores[entry.first] = entry.second;
+}
+
+// The multi-threaded implementation of connect_children() only does lock-free
+// lookups in fen2index. The lists of children from initialize_tb() (or the
+// chunks read back from spilled_children) are looked up in parallel parts,
+// without spawning any children again, the nodes of a deepened tree before
+// deepen_from are connected by connect_resumed(), and at the end all the edges
+// are stored in tb.children with a count-then-fill build.
+template <typename Key> void MateTB<Key>::connect_children() {
+  auto tic = std::chrono::high_resolution_clock::now();
+  out << "Connect child nodes ... " << std::endl;
+  size_t dim = fen2index.size();
+  std::vector<std::vector<edge_t>> thread_edges(pool.size());
+  // connects the children that are in the tree
+  auto connect = [&](const std::vector<child_t> &children) {
+    pool.parallel_for(children.size(), 4096,
+                      [&](size_t begin, size_t end, size_t thread_id) {
+                        connect_unconnected(children.data() + begin,
+                                            children.data() + end,
+                                            thread_edges[thread_id]);
+                      });
+  };
+  for (auto &children : unconnected) {
+    connect(children);
+    children = {};
+  }
+  unconnected.clear();
+  std::vector<child_t> chunk;
+  for (auto &buffer : spilled_children)
+    while (buffer.read(chunk))
+      connect(chunk);
+  spilled_children.clear();
+  for (auto &local_edges : thread_edges)
+    edges.push_back(std::move(local_edges));
+  if (deepen_from > 0)
+    connect_resumed();
+  build_csr(tb.children, dim, edges);
+  edges.clear();
+  tb.parents = reverse_csr(tb.children);
+  auto toc = std::chrono::high_resolution_clock::now();
+  double duration =
+      std::chrono::duration_cast<std::chrono::milliseconds>(toc - tic).count() /
+      1000.0;
+  stats_.edges = tb.children.edges.size();
+  stats_.connect_seconds = std::chrono::duration<double>(toc - tic).count();
+  out << "Connected " << tb.size() << " positions in " << std::fixed
+      << std::setprecision(2) << duration << "s" << std::endl;
+}
+
+// Connects the nodes of a deepened tree before deepen_from: the old tree is
+// walked again level by level along the allowed moves, from the root, and the
+// nodes of a level are reconnected in parallel with reconnect_resumed_node().
+// A node joins the next level once, when its flag in visited is set. With
+// --memoryLimit the levels are read back in chunks from SpillBuffers.
+template <typename Key> void MateTB<Key>::connect_resumed() {
+  std::vector<std::atomic<bool>> visited(fen2index.size());
+  auto visit = [&](index_t idx) { return !visited[idx].exchange(true); };
+  std::vector<thread_buffers_t> buffers(pool.size());
+  SpillBuffer<node_t> level(spill_dir, spill_entries<node_t>());
+  PackedBoard root = canonical(Board::Compact::encode(root_pos));
+  index_t root_idx = find_index(root);
+  visited[root_idx] = true;
+  level.append({{root, root_idx}});
+  std::vector<node_t> nodes;
+  for (int depth = 0; !level.empty(); ++depth) {
+    SpillBuffer<node_t> next_level(spill_dir, spill_entries<node_t>());
+    while (level.read(nodes)) {
+      pool.parallel_for(
+          nodes.size(), std::max(size_t(128), nodes.size() / (concurrency * 8)),
+          [&](size_t begin, size_t end, size_t thread_id) {
+            auto &buffer = buffers[thread_id];
+            for (size_t i = begin; i < end; ++i)
+              reconnect_resumed_node(nodes[i], depth, visit, buffer.next_level,
+                                     buffer.edges, buffer.children,
+                                     buffer.other_children);
+          });
+      for (auto &buffer : buffers)
+        next_level.append(std::move(buffer.next_level));
+    }
+    level = std::move(next_level);
+  }
+  for (auto &buffer : buffers)
+    edges.push_back(std::move(buffer.edges));
+}
+
+// With --numa the scores and the graph are copied before the TB generation to
+// memory that is first written by the thread of each range of static_for(), so
+// that the pages of a range are on the NUMA node of its thread.
+template <typename Key> void MateTB<Key>::place_tb() {
+  size_t dim = tb.size();
+  uninit_vector_t<score_t> scores(dim);
+  pool.static_for(dim, [&](size_t begin, size_t end) {
+    std::copy(tb.scores.begin() + begin, tb.scores.begin() + end,
+              scores.begin() + begin);
+  });
+  tb.scores = std::move(scores);
+  for (csr_t *csr : {&tb.children, &tb.parents}) {
+    csr_t placed;
+    placed.offsets.resize(dim + 1);
+    placed.edges.resize(csr->edges.size());
+    pool.static_for(dim, [&](size_t begin, size_t end) {
+      std::copy(csr->offsets.begin() + begin, csr->offsets.begin() + end,
+                placed.offsets.begin() + begin);
+      std::copy(csr->edges.begin() + csr->offsets[begin],
+                csr->edges.begin() + csr->offsets[end],
+                placed.edges.begin() + csr->offsets[begin]);
+    });
+    placed.offsets[dim] = csr->offsets[dim];
+    *csr = std::move(placed);
+  }
+}
+
+// Calls func(begin, end) in parallel for ranges of the positions in nodes. With
+// --numa the nodes are sorted, and each thread gets the nodes in its own range
+// of static_for().
+template <typename Key>
+template <typename F>
+void MateTB<Key>::for_nodes(std::vector<index_t> &nodes, F &&func) {
+  if (!numa) {
+    pool.parallel_for(nodes.size(),
+                      std::max(size_t(128), nodes.size() / (concurrency * 32)),
+                      func);
+    return;
+  }
+  std::sort(nodes.begin(), nodes.end());
+  pool.static_for(tb.children.size(), [&](size_t begin, size_t end) {
+    size_t first =
+        std::lower_bound(nodes.begin(), nodes.end(), begin) - nodes.begin();
+    size_t last =
+        std::lower_bound(nodes.begin(), nodes.end(), end) - nodes.begin();
+    if (first < last)
+      func(first, last);
+  });
+}
+
+// The multi-threaded implementation of generate_tb() is a retrograde analysis
+// in synchronous rounds: first the new scores for all the nodes in the frontier
+// are computed from their children, and then the changed scores are written
+// and the parents of the changed nodes form the next frontier. So reads and
+// writes of tb.scores never overlap.
+template <typename Key> void MateTB<Key>::generate_tb() {
+  auto tic = std::chrono::high_resolution_clock::now();
+  out << "Generate tablebase ..." << std::endl;
+  if (numa)
+    place_tb();
+  std::vector<index_t> frontier;
+  std::vector<std::atomic<bool>> queued(tb.size());
+  for (index_t idx = 0; idx < tb.size(); ++idx)
+    if (tb.scores[idx])
+      for (index_t parent : tb.parents[idx])
+        if (!queued[parent].exchange(true))
+          frontier.push_back(parent);
+  int iteration = 0;
+  while (!frontier.empty()) {
+    std::vector<score_t> new_score(frontier.size());
+    auto score_batch = [&](size_t begin, size_t end) {
+      for (size_t j = begin; j < end; ++j) {
+        queued[frontier[j]] = false;
+        new_score[j] = best_child_score(frontier[j]);
+      }
+    };
+    for_nodes(frontier, score_batch);
+    std::vector<index_t> next_frontier;
+    std::mutex next_frontier_mutex;
+    std::atomic<int> changed = 0;
+    auto update_batch = [&](size_t begin, size_t end) {
+      std::vector<index_t> local_next_frontier;
+      int batch_changed = 0;
+      for (size_t j = begin; j < end; ++j) {
+        index_t idx = frontier[j];
+        score_t best_score = new_score[j];
+        if (best_score == VALUE_NONE || tb.scores[idx] == best_score)
+          continue;
+        tb.scores[idx] = best_score;
+        batch_changed++;
+        for (index_t parent : tb.parents[idx])
+          if (!queued[parent].exchange(true))
+            local_next_frontier.push_back(parent);
+      }
+      changed += batch_changed;
+      if (!local_next_frontier.empty()) {
+        std::lock_guard<std::mutex> lock(next_frontier_mutex);
+        next_frontier.insert(next_frontier.end(), local_next_frontier.begin(),
+                             local_next_frontier.end());
+      }
+    };
+    for_nodes(frontier, update_batch);
+    stats_.updates += frontier.size();
+    if (collect_stats)
+      details.changed.push_back(changed);
+    frontier = std::move(next_frontier);
+    iteration++;
+    out << "Iteration " << iteration << ", changed " << std::setw(9) << changed
+        << " scores\r" << std::flush;
+    checkpoint_iteration(iteration);
+  }
+  auto toc = std::chrono::high_resolution_clock::now();
+  double duration =
+      std::chrono::duration_cast<std::chrono::milliseconds>(toc - tic).count() /
+      1000.0;
+  stats_.iterations = iteration;
+  stats_.generate_seconds = std::chrono::duration<double>(toc - tic).count();
+  out << "Tablebase generated with " << iteration << " iterations in "
+      << std::fixed << std::setprecision(2) << duration << "s" << std::endl;
+}
+
+// The multi-threaded implementation of generate_tb_by_levels() resolves each
+// level in parallel: a parent is claimed by the one thread that writes its
+// compact score with a CAS. The compact scores read in a level were all written
+// in the previous levels.
+template <typename Key> void MateTB<Key>::generate_tb_by_levels() {
+  auto tic = std::chrono::high_resolution_clock::now();
+  out << "Generate tablebase ..." << std::endl;
+  if (numa)
+    place_tb();
+  std::vector<std::vector<index_t>> levels = scored_levels();
+  // accessed through std::atomic_ref, unresolved[idx] <= 218 legal moves
+  uninit_vector_t<std::uint8_t> unresolved(tb.size());
+  pool.static_for(tb.size(), [&](size_t begin, size_t end) {
+    for (size_t idx = begin; idx < end; ++idx)
+      unresolved[idx] = tb.children[idx].size();
+  });
+  int ply = 0;
+  if (int(levels.size()) <= max_compact_ply<std::uint8_t>() + 1)
+    ply = resolve_levels<std::uint8_t>(levels, ply, unresolved);
+  if (ply < int(levels.size())) {
+    out << "Widen the scores to 16 bits at ply " << ply << "." << std::endl;
+    ply = resolve_levels<std::uint16_t>(levels, ply, unresolved);
+  }
+  auto toc = std::chrono::high_resolution_clock::now();
+  double duration =
+      std::chrono::duration_cast<std::chrono::milliseconds>(toc - tic).count() /
+      1000.0;
+  stats_.iterations = ply;
+  stats_.generate_seconds = std::chrono::duration<double>(toc - tic).count();
+  out << "Tablebase generated with " << ply << " plies in " << std::fixed
+      << std::setprecision(2) << duration << "s" << std::endl;
+}
+
+template <typename Key>
+template <typename T>
+int MateTB<Key>::resolve_levels(std::vector<std::vector<index_t>> &levels,
+                                int ply,
+                                uninit_vector_t<std::uint8_t> &unresolved) {
+  size_t dim = tb.size();
+  uninit_vector_t<T> compact(dim);
+  pool.static_for(dim, [&](size_t begin, size_t end) {
+    compact_scores(compact, begin, end);
+  });
+  uninit_vector_t<score_t>().swap(tb.scores);
+  auto expand = [&]() {
+    tb.scores.resize(dim);
+    pool.static_for(dim, [&](size_t begin, size_t end) {
+      expand_scores(compact, begin, end);
+    });
+  };
+  for (; ply < int(levels.size()) && ply + 1 <= max_compact_ply<T>(); ++ply) {
+    std::vector<index_t> &level = levels[ply];
+    std::vector<index_t> next_level;
+    std::mutex next_level_mutex;
+    bool lost = ply % 2 == 0;
+    T parent_score = ply + 2;
+    auto resolve_batch = [&](size_t begin, size_t end) {
+      std::vector<index_t> local_next_level;
+      for (size_t j = begin; j < end; ++j)
+        for (index_t parent : tb.parents[level[j]]) {
+          std::atomic_ref<T> score(compact[parent]);
+          T unresolved_score = 0;
+          if (!score &&
+              (lost ||
+               --std::atomic_ref<std::uint8_t>(unresolved[parent]) == 0) &&
+              score.compare_exchange_strong(unresolved_score, parent_score))
+            local_next_level.push_back(parent);
+        }
+      if (!local_next_level.empty()) {
+        std::lock_guard<std::mutex> lock(next_level_mutex);
+        next_level.insert(next_level.end(), local_next_level.begin(),
+                          local_next_level.end());
+      }
+    };
+    for_nodes(level, resolve_batch);
+    stats_.updates += level.size();
+    if (collect_stats)
+      details.changed.push_back(level.size());
+    out << "Ply " << ply << ", resolved " << std::setw(9) << level.size()
+        << " scores\r" << std::flush;
+    std::vector<index_t>().swap(levels[ply]);
+    if (!next_level.empty()) {
+      if (int(levels.size()) == ply + 1)
+        levels.emplace_back();
+      levels[ply + 1].insert(levels[ply + 1].end(), next_level.begin(),
+                             next_level.end());
+    }
+    if (checkpoint_due(ply + 1)) {
+      expand();
+      checkpoint_scores(false);
+      uninit_vector_t<score_t>().swap(tb.scores);
+    }
+  }
+  expand();
+  return ply;
+}
+
+// the PVs of the multipv lines are extracted in parallel
+template <typename Key>
+void MateTB<Key>::for_lines(
+    std::size_t n, const std::function<void(std::size_t, std::size_t)> &func) {
+  pool.parallel_for(n, 1, func);
+}
@@ -1,12 +1,17 @@
 #pragma once
 
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <iterator>
 #include <limits>
 #include <map>
+#include <memory>
 #include <regex>
 #include <sstream>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 using score_t = std::int16_t;
@@ -16,6 +21,48 @@ using book_t = std::map<std::string, std::string>;
 constexpr score_t VALUE_NONE = 30001;
 constexpr score_t VALUE_MATE = 30000;
 constexpr int MAX_DEPTH = std::numeric_limits<int>::max() - 1;
+constexpr index_t NO_INDEX = std::numeric_limits<index_t>::max();
+
+// the distance to mate of a nonzero score in plies, 0 for -VALUE_MATE
+inline int mate_ply(score_t score) { return VALUE_MATE - std::abs(score); }
+inline score_t ply_score(int ply) {
+  return ply % 2 ? VALUE_MATE - ply : -VALUE_MATE + ply;
+}
+
+// A compact score of unsigned type T is 0 for a score of 0 and 1 + mate_ply()
+// otherwise, the sign follows from the parity. A byte holds the mates of up to
+// 254 plies.
+template <typename T> constexpr int max_compact_ply() {
+  return std::numeric_limits<T>::max() - 1;
+}
+template <typename T> T compact_score(score_t score) {
+  return score ? T(1 + mate_ply(score)) : T(0);
+}
+template <typename T> score_t expand_score(T compact) {
+  return compact ? ply_score(compact - 1) : 0;
+}
+
+// an allocator that default-initializes: resize() of a vector of a trivial
+// type leaves the new elements uninitialized, so that their memory is only
+// touched (and placed on a NUMA node) when they are first written
+template <typename T> struct default_init_allocator : std::allocator<T> {
+  template <typename U> struct rebind {
+    using other = default_init_allocator<U>;
+  };
+  default_init_allocator() noexcept = default;
+  template <typename U>
+  default_init_allocator(const default_init_allocator<U> &) noexcept {}
+  template <typename U> void construct(U *p) {
+    ::new (static_cast<void *>(p)) U;
+  }
+  template <typename U, typename... Args>
+  void construct(U *p, Args &&...args) {
+    ::new (static_cast<void *>(p)) U(std::forward<Args>(args)...);
+  }
+};
+
+template <typename T>
+using uninit_vector_t = std::vector<T, default_init_allocator<T>>;
 
 template <typename T> void split(const std::string &s, char delim, T result) {
   std::istringstream iss(s);
@@ -48,6 +95,21 @@ inline std::string enclosed_string(const std::string &s) {
   return s;
 }
 
+// s as a quoted JSON string
+inline std::string json_string(const std::string &s) {
+  std::string json = "\"";
+  for (char c : s)
+    if (c == '"' || c == '\\')
+      json += std::string("\\") + c;
+    else if (static_cast<unsigned char>(c) < 0x20) {
+      char escaped[7];
+      std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      json += escaped;
+    } else
+      json += c;
+  return json + "\"";
+}
+
 inline std::string cdb_link(const std::string &root_pos,
                             const std::string &pv_str) {
   auto s = "https://chessdb.cn/queryc_en/?" + root_pos + " moves " + pv_str;
@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <cstdlib>
 #include <iostream>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <thread>
@@ -11,26 +12,40 @@
 #include "external/argparse.hpp"
 #include "misc.hpp"
 
+// the default of --batchPositions
+constexpr std::size_t BATCH_POSITIONS = 1000000;
+
 class Options {
 public:
   std::string epdStr, openingMoves, excludeMoves, excludeSANs, restrictTo,
       excludeFrom, excludeTo, excludeCapturesOf, excludePromotionTo,
       excludeAllowingFrom, excludeAllowingTo, excludeAllowingMoves,
-      excludeAllowingSANs, outFile;
+      excludeAllowingSANs, outFile, saveTb, loadTb, keyMode, solver,
+      symmetry, checkpoint, resume, spillDir, epdFile, resultsFile, shardDir;
   bool excludeCaptures, excludeToAttacked, excludeToCapturable,
-      excludeAllowingCapture;
-  int depth, verbose, concurrency;
+      excludeAllowingCapture, reduce, renumber, numa, stats;
+  int depth, verbose, concurrency, checkpointEvery, shards, shard;
+  std::size_t expectedPositions, memoryLimit, batchPositions;
   Options()
       : epdStr(""), openingMoves(""), excludeMoves(""), excludeSANs(""),
         restrictTo(""), excludeFrom(""), excludeTo(""), excludeCapturesOf(""),
         excludePromotionTo(""), excludeAllowingFrom(""), excludeAllowingTo(""),
         excludeAllowingMoves(""), excludeAllowingSANs(""), outFile(""),
-        excludeCaptures(false), excludeToAttacked(false),
-        excludeToCapturable(false), excludeAllowingCapture(false),
-        depth(MAX_DEPTH), verbose(0), concurrency(0) {}
+        saveTb(""), loadTb(""), keyMode("packed"), solver("levels"),
+        symmetry("auto"), checkpoint(""), resume(""), spillDir(""), epdFile(""),
+        resultsFile(""), shardDir(""), excludeCaptures(false),
+        excludeToAttacked(false), excludeToCapturable(false),
+        excludeAllowingCapture(false), reduce(false), renumber(false),
+        numa(false), stats(false), depth(MAX_DEPTH), verbose(0), concurrency(0),
+        checkpointEvery(0), shards(1), shard(0), expectedPositions(0),
+        memoryLimit(0), batchPositions(BATCH_POSITIONS) {}
   Options(int argc, char **argv, bool use_concurrency = false);
   void fill_exclude_options();
   void print(std::ostream &os) const;
+  // the opening book and the excludes
+  void print_excludes(std::ostream &os) const;
+  // the options that the game tree depends on, besides the EPD and --depth
+  std::string tree_options() const;
 };
 
 inline Options::Options(int argc, char **argv, bool use_concurrency)
@@ -43,6 +58,16 @@ inline Options::Options(int argc, char **argv, bool use_concurrency)
       .default_value("8/8/8/1p6/6k1/1p2Q3/p1p1p3/rbrbK3 w - - bm #36;")
       .help("EPD for the root position. If bm is not given, it is assumed that "
             "the side to move is mating.");
+  args.add_argument("--epdFile")
+      .default_value("")
+      .help("File with one EPD per line to solve in a batch instead of --epd, "
+            "each with the excludes known for it. Lines containing \"needs "
+            "engine\" are skipped, and lines containing \"finds\" may match "
+            "without the mate length.");
+  args.add_argument("--resultsFile")
+      .default_value("")
+      .help("Optional output file for the results of --epdFile, with one JSON "
+            "object per line.");
   args.add_argument("--depth")
       .default_value(MAX_DEPTH)
       .action([](const std::string &value) { return std::stoi(value); })
@@ -114,6 +139,68 @@ inline Options::Options(int argc, char **argv, bool use_concurrency)
   args.add_argument("--outFile")
       .default_value("")
       .help("Optional output file for the TB.");
+  args.add_argument("--saveTb")
+      .default_value("")
+      .help("Optional output file for the TB in binary format.");
+  args.add_argument("--loadTb")
+      .default_value("")
+      .help("Binary TB file to probe instead of generating the TB. The root "
+            "position and the key mode are taken from the file.");
+  args.add_argument("--keyMode")
+      .default_value("packed")
+      .choices("packed", "zobrist", "zobrist-verified")
+      .help("Key of the positions in the hash table: the 24 byte packed board, "
+            "a 64 bit Zobrist hash, or a Zobrist hash that is checked for "
+            "collisions.");
+  args.add_argument("--solver")
+      .default_value("levels")
+      .choices("levels", "iterative")
+      .help("Algorithm for the TB generation: resolve the positions ply by "
+            "ply in increasing distance to mate, or iterate the scores until "
+            "they no longer change.");
+  args.add_argument("--symmetry")
+      .default_value("auto")
+      .choices("auto", "off")
+      .help("Store the positions that are mirror images or rotations of each "
+            "other only once, for the symmetries that the restrictions and "
+            "the opening book allow.");
+  args.add_argument("--reduce")
+      .default_value(false)
+      .implicit_value(true)
+      .help("Remove the positions that cannot reach a mate in the game tree "
+            "once it is connected, so that the TB generation and the saved TB "
+            "only hold the others. The scores and the PVs do not change, but "
+            "the removed positions probe as VALUE_NONE (not in the TB) in "
+            "--outFile, --saveTb and the probe API.");
+  args.add_argument("--renumber")
+      .default_value(false)
+      .implicit_value(true)
+      .help("Renumber the positions in BFS order once the game tree is "
+            "connected, so that the TB generation reads more local memory and "
+            "the indices do not depend on the threads.");
+  args.add_argument("--stats")
+      .default_value(false)
+      .implicit_value(true)
+      .help("Collect and print statistics of the TB generation: the moves "
+            "rejected by each exclude, the duplicates per depth, the probe "
+            "lengths of the hash table, the scores changed per iteration and "
+            "the memory after each phase.");
+  args.add_argument("--checkpoint")
+      .default_value("")
+      .help("Optional directory to save the state of the TB generation to "
+            "after each phase.");
+  args.add_argument("--checkpointEvery")
+      .default_value(0)
+      .action([](const std::string &value) { return std::stoi(value); })
+      .help("Also save the scores every N iterations (or plies) of the TB "
+            "generation.");
+  args.add_argument("--resume")
+      .default_value("")
+      .help("Directory with a checkpoint to continue from, after its last "
+            "completed phase (remove scores.bin to only rerun the TB "
+            "generation). The checkpoint has to be for the same EPD, "
+            "opening book, excludes, --keyMode and --symmetry. With a larger "
+            "--depth the game tree of the checkpoint is deepened.");
   args.add_argument("--verbose")
       .default_value(0)
       .action([](const std::string &value) { return std::stoi(value); })
@@ -125,6 +212,63 @@ inline Options::Options(int argc, char **argv, bool use_concurrency)
         .default_value(int(std::thread::hardware_concurrency()))
         .action([](const std::string &value) { return std::stoi(value); })
         .help("Number of concurrent threads to use.");
+  if (use_concurrency)
+    args.add_argument("--expectedPositions")
+        .default_value(std::size_t(0))
+        .action([](const std::string &value) {
+          return std::size_t(std::stoull(value));
+        })
+        .help("Estimated number of positions in the game tree, used to size "
+              "the hash table (it grows if needed).");
+  if (use_concurrency)
+    args.add_argument("--memoryLimit")
+        .default_value(std::size_t(0))
+        .action([](const std::string &value) {
+          return std::size_t(std::stoull(value));
+        })
+        .help("Memory in MB for the BFS levels and the children left to "
+              "connect while the game tree is created. Beyond it they are "
+              "spilled to sorted files on disk (0 means no limit). Only these "
+              "buffers are bounded: the hash table of the positions, the "
+              "graph and the scores stay in memory.");
+  if (use_concurrency)
+    args.add_argument("--spillDir")
+        .default_value("")
+        .help("Directory for the files spilled with --memoryLimit (default is "
+              "the system's temporary directory).");
+  if (use_concurrency)
+    args.add_argument("--batchPositions")
+        .default_value(BATCH_POSITIONS)
+        .action([](const std::string &value) {
+          return std::size_t(std::stoull(value));
+        })
+        .help("Puzzles of --epdFile with up to this many positions are solved "
+              "concurrently with one thread each, the larger ones afterwards "
+              "one at a time with all the threads.");
+  if (use_concurrency)
+    args.add_argument("--numa")
+        .default_value(false)
+        .implicit_value(true)
+        .help("Pin the threads to the CPUs, and split the positions into one "
+              "range per thread for the TB generation: each range is placed "
+              "in memory and processed by its own thread.");
+  if (use_concurrency)
+    args.add_argument("--shards")
+        .default_value(1)
+        .action([](const std::string &value) { return std::stoi(value); })
+        .help("Number of processes (e.g. on different machines) that generate "
+              "the TB together, each one for the positions of its shard.");
+  if (use_concurrency)
+    args.add_argument("--shard")
+        .default_value(0)
+        .action([](const std::string &value) { return std::stoi(value); })
+        .help("Shard of this process, from 0 to --shards - 1. Shard 0 merges "
+              "the shards of the TB and shows the result.");
+  if (use_concurrency)
+    args.add_argument("--shardDir")
+        .default_value("")
+        .help("Directory shared by all the shards, through which they exchange "
+              "the positions and the scores. It must be empty at the start.");
   try {
     args.parse_args(argc, argv);
   } catch (const std::runtime_error &err) {
@@ -133,6 +277,8 @@ inline Options::Options(int argc, char **argv, bool use_concurrency)
     std::exit(1);
   }
   epdStr = args.get("epd");
+  epdFile = args.get("epdFile");
+  resultsFile = args.get("resultsFile");
   depth = args.get<int>("depth");
   openingMoves = args.get("openingMoves");
   excludeMoves = args.get("excludeMoves");
@@ -151,10 +297,58 @@ inline Options::Options(int argc, char **argv, bool use_concurrency)
   excludeAllowingMoves = args.get("excludeAllowingMoves");
   excludeAllowingSANs = args.get("excludeAllowingSANs");
   outFile = args.get("outFile");
+  saveTb = args.get("saveTb");
+  loadTb = args.get("loadTb");
+  keyMode = args.get("keyMode");
+  solver = args.get("solver");
+  symmetry = args.get("symmetry");
+  reduce = args.get<bool>("reduce");
+  renumber = args.get<bool>("renumber");
+  stats = args.get<bool>("stats");
+  checkpoint = args.get("checkpoint");
+  checkpointEvery = args.get<int>("checkpointEvery");
+  resume = args.get("resume");
   verbose = args.get<int>("verbose");
-  if (use_concurrency)
+  if (use_concurrency) {
     concurrency = std::max(1, args.get<int>("concurrency"));
-  fill_exclude_options();
+    expectedPositions = args.get<std::size_t>("expectedPositions");
+    memoryLimit = args.get<std::size_t>("memoryLimit");
+    spillDir = args.get("spillDir");
+    batchPositions = args.get<std::size_t>("batchPositions");
+    numa = args.get<bool>("numa");
+    shards = args.get<int>("shards");
+    shard = args.get<int>("shard");
+    shardDir = args.get("shardDir");
+  }
+  if (!epdFile.empty() && (!outFile.empty() || !saveTb.empty() ||
+                           !loadTb.empty() || !checkpoint.empty() ||
+                           !resume.empty())) {
+    std::cerr << "--epdFile cannot be combined with --outFile, --saveTb, "
+                 "--loadTb, --checkpoint or --resume."
+              << std::endl;
+    std::exit(1);
+  }
+  // a deepened tree needs the positions that cannot reach a mate yet
+  if (reduce && !checkpoint.empty()) {
+    std::cerr << "--reduce cannot be combined with --checkpoint." << std::endl;
+    std::exit(1);
+  }
+  if (shards > 1 &&
+      (shard < 0 || shard >= shards || shardDir.empty() || !epdFile.empty() ||
+       !loadTb.empty() || !checkpoint.empty() || !resume.empty() ||
+       memoryLimit || reduce || renumber || solver != "levels" ||
+       keyMode == "zobrist-verified")) {
+    std::cerr << "--shards needs a --shard below it and a --shardDir, and "
+                 "cannot be combined with --epdFile, --loadTb, --checkpoint, "
+                 "--resume, --memoryLimit, --reduce, --renumber, --solver "
+                 "iterative or --keyMode zobrist-verified."
+              << std::endl;
+    std::exit(1);
+  }
+  // the moves of a loaded TB are not restricted any further, and the excludes
+  // of a batch are filled in for each of its EPDs
+  if (loadTb.empty() && epdFile.empty())
+    fill_exclude_options();
 }
 
 inline void Options::fill_exclude_options() {
@@ -600,10 +794,7 @@ inline void Options::fill_exclude_options() {
   // clang-format on
 }
 
-inline void Options::print(std::ostream &os) const {
-  os << "--epd \"" << epdStr << "\" ";
-  if (depth < MAX_DEPTH)
-    os << "--depth " << depth << " ";
+inline void Options::print_excludes(std::ostream &os) const {
   if (!openingMoves.empty())
     os << "--openingMoves " << enclosed_string(openingMoves) << " ";
   if (!excludeMoves.empty())
@@ -639,10 +830,64 @@ inline void Options::print(std::ostream &os) const {
   if (!excludeAllowingSANs.empty())
     os << "--excludeAllowingSANs " << enclosed_string(excludeAllowingSANs)
        << " ";
+}
+
+inline std::string Options::tree_options() const {
+  std::ostringstream ss;
+  print_excludes(ss);
+  ss << "--keyMode " << keyMode << " --symmetry " << symmetry;
+  return ss.str();
+}
+
+inline void Options::print(std::ostream &os) const {
+  if (!epdFile.empty())
+    os << "--epdFile " << enclosed_string(epdFile) << " ";
+  else
+    os << "--epd \"" << epdStr << "\" ";
+  if (!resultsFile.empty())
+    os << "--resultsFile " << enclosed_string(resultsFile) << " ";
+  if (depth < MAX_DEPTH)
+    os << "--depth " << depth << " ";
+  print_excludes(os);
   if (concurrency)
     os << "--concurrency " << concurrency << " ";
+  if (expectedPositions)
+    os << "--expectedPositions " << expectedPositions << " ";
+  if (memoryLimit)
+    os << "--memoryLimit " << memoryLimit << " ";
+  if (!spillDir.empty())
+    os << "--spillDir " << enclosed_string(spillDir) << " ";
+  if (!epdFile.empty() && batchPositions != BATCH_POSITIONS)
+    os << "--batchPositions " << batchPositions << " ";
+  if (numa)
+    os << "--numa ";
+  if (shards > 1)
+    os << "--shards " << shards << " --shard " << shard << " --shardDir "
+       << enclosed_string(shardDir) << " ";
   if (!outFile.empty())
     os << "--outFile " << enclosed_string(outFile) << " ";
+  if (!saveTb.empty())
+    os << "--saveTb " << enclosed_string(saveTb) << " ";
+  if (!loadTb.empty())
+    os << "--loadTb " << enclosed_string(loadTb) << " ";
+  if (keyMode != "packed")
+    os << "--keyMode " << keyMode << " ";
+  if (solver != "levels")
+    os << "--solver " << solver << " ";
+  if (symmetry != "auto")
+    os << "--symmetry " << symmetry << " ";
+  if (reduce)
+    os << "--reduce ";
+  if (renumber)
+    os << "--renumber ";
+  if (stats)
+    os << "--stats ";
+  if (!checkpoint.empty())
+    os << "--checkpoint " << enclosed_string(checkpoint) << " ";
+  if (checkpointEvery)
+    os << "--checkpointEvery " << checkpointEvery << " ";
+  if (!resume.empty())
+    os << "--resume " << enclosed_string(resume) << " ";
 }
 
 inline std::ostream &operator<<(std::ostream &os, const Options &opt) {
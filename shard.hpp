@@ -0,0 +1,323 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "external/chess.hpp"
+#include "external/threadpool.hpp"
+#include "matetb_threaded.hpp"
+
+// the shard that owns pfen, from the high bits of its hash (the low bits pick
+// the slots of the hash tables)
+inline int shard_of(const PackedBoard &pfen, int shards) {
+  return int((unsigned __int128)(PackedBoardHash{}(pfen)) * shards >> 64);
+}
+
+// The messages between the processes of a sharded TB generation, exchanged as
+// files in a directory that all of them share (e.g. on NFS). The rounds are
+// bulk synchronous: each shard sends one (possibly empty) batch to every shard,
+// and then waits for the batches of all the shards. A batch is written to a
+// temporary file and renamed, so that it only appears once it is complete.
+class ShardExchange {
+public:
+  ShardExchange(const std::string &dir, int shards, int shard)
+      : dir_(dir), shards_(shards), shard_(shard) {
+    std::filesystem::create_directories(dir_);
+  }
+
+  int shards() const { return shards_; }
+  int shard() const { return shard_; }
+
+  // sends outbox[to] to each shard to, and returns the concatenation of the
+  // batches sent to this shard in round
+  template <typename T>
+  std::vector<T> exchange(const std::string &round,
+                          const std::vector<std::vector<T>> &outbox) {
+    for (int to = 0; to < shards_; ++to) {
+      auto path = batch_path(round, shard_, to);
+      if (std::filesystem::exists(path)) {
+        std::cout << "Stale batch " << path << ", use an empty --shardDir."
+                  << std::endl;
+        std::exit(1);
+      }
+      auto tmp_path = path;
+      tmp_path += ".tmp";
+      std::ofstream f(tmp_path, std::ios::binary);
+      f.write(reinterpret_cast<const char *>(outbox[to].data()),
+              outbox[to].size() * sizeof(T));
+      f.close();
+      if (!f) {
+        std::cout << "Error writing batch " << tmp_path << "." << std::endl;
+        std::exit(1);
+      }
+      std::filesystem::rename(tmp_path, path);
+    }
+    std::vector<T> inbox;
+    for (int from = 0; from < shards_; ++from) {
+      auto path = batch_path(round, from, shard_);
+      while (!std::filesystem::exists(path))
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      std::size_t offset = inbox.size();
+      inbox.resize(offset + std::filesystem::file_size(path) / sizeof(T));
+      std::ifstream f(path, std::ios::binary);
+      f.read(reinterpret_cast<char *>(inbox.data() + offset),
+             (inbox.size() - offset) * sizeof(T));
+      if (!f) {
+        std::cout << "Error reading batch " << path << "." << std::endl;
+        std::exit(1);
+      }
+      f.close();
+      std::filesystem::remove(path);
+    }
+    return inbox;
+  }
+
+  // the sum of value over all the shards, which also synchronizes them
+  std::size_t sum(const std::string &round, std::size_t value) {
+    auto values = exchange(
+        round, std::vector<std::vector<std::size_t>>(shards_, {value}));
+    return std::accumulate(values.begin(), values.end(), std::size_t(0));
+  }
+
+  std::string path(const std::string &name) const {
+    return (std::filesystem::path(dir_) / name).string();
+  }
+
+private:
+  std::filesystem::path batch_path(const std::string &round, int from,
+                                   int to) const {
+    return std::filesystem::path(dir_) /
+           (round + "." + std::to_string(from) + "." + std::to_string(to));
+  }
+
+  std::string dir_;
+  int shards_, shard_;
+};
+
+// One shard of the game tree, which holds the positions whose shard_of() is
+// its shard. A position has the global index local index * shards + shard, so
+// that its shard follows from its index. The phases are those of MateTB, in
+// rounds of ShardExchange:
+// - the BFS expands the level of each shard, and sends the allowed children
+//   to their shards, which insert them into their fen2index
+// - the other children are sent to their shards, which connect them to their
+//   parents if they are in the tree, and the shards of the parents are told
+//   how many children each parent has
+// - the levels solver sends the parents of the nodes resolved at a ply to
+//   their shards, which resolve them as in MateTB::resolve_levels()
+// Each shard keeps the global indices of the parents of its nodes in
+// tb.parents, but tb.children is not built: only the number of children of
+// each node is needed.
+template <typename Key>
+class ShardedMateTB : public MateTbBase<index_map_t<Key>> {
+  using Base = MateTbBase<index_map_t<Key>>;
+  using Base::canonical, Base::collect_stats, Base::details, Base::edges,
+      Base::fen2index, Base::max_depth, Base::openingBook, Base::out,
+      Base::scored_levels, Base::spawn_children, Base::stats_, Base::tb;
+  ShardExchange &exchange;
+  ThreadPool &pool;
+  int shards, shard;
+  // the other children by the shard of their position, which are sent to it
+  // by connect_children()
+  std::vector<std::vector<child_t>> candidates;
+  uninit_vector_t<std::uint8_t> child_count; // at most 218 moves
+
+  index_t global_index(index_t idx) const { return idx * shards + shard; }
+  void initialize_tb() override;
+  void connect_children() override;
+  void generate_tb() override { generate_tb_by_levels(); }
+  void generate_tb_by_levels() override;
+
+public:
+  ShardedMateTB(const Options &options, ShardExchange &shard_exchange,
+                ThreadPool &thread_pool)
+      : Base(options), exchange(shard_exchange), pool(thread_pool),
+        shards(shard_exchange.shards()), shard(shard_exchange.shard()) {
+    fen2index.reserve(options.expectedPositions / shards);
+  }
+};
+
+template <typename Key> void ShardedMateTB<Key>::initialize_tb() {
+  auto tic = std::chrono::high_resolution_clock::now();
+  out << "Create the allowed part of the game tree in shard " << shard << " of "
+      << shards << " ..." << std::endl;
+  std::vector<node_t> level, next_level;
+  std::vector<index_t> mates;
+  std::size_t count = 0;
+  std::vector<filter_stats_t> filter_stats(collect_stats ? pool.size() : 0);
+  edges.clear();
+  candidates.assign(shards, {});
+  PackedBoard root = canonical(Board::Compact::encode(this->root_pos));
+  if (shard_of(root, shards) == shard) {
+    fen2index.emplace(position_key<Key>(root), count++);
+    level.push_back({root, 0});
+    if (collect_stats)
+      details.count_depth(0, 1, 0);
+  }
+  int depth = 0;
+  for (;; depth++) {
+    // each thread sorts the children of its nodes by their shards
+    std::vector<std::vector<std::vector<child_t>>> children(
+        pool.size(), std::vector<std::vector<child_t>>(shards)),
+        other_children = children;
+    std::vector<std::vector<index_t>> local_mates(pool.size());
+    pool.parallel_for(
+        level.size(), 128,
+        [&](std::size_t begin, std::size_t end, std::size_t thread_id) {
+          std::vector<child_t> allowed, others;
+          // the owner of a child is that of its canonical position
+          auto send = [&](auto &batches, const std::vector<child_t> &spawned) {
+            for (const auto &child : spawned) {
+              PackedBoard pfen = canonical(child.pfen);
+              batches[thread_id][shard_of(pfen, shards)].push_back(
+                  {pfen, global_index(child.parent)});
+            }
+          };
+          for (std::size_t i = begin; i < end; ++i) {
+            auto board = Board::Compact::decode(level[i].pfen);
+            Movelist legal_moves;
+            movegen::legalmoves(legal_moves, board);
+            if (legal_moves.size() == 0 && board.inCheck()) {
+              local_mates[thread_id].push_back(level[i].idx);
+              continue;
+            }
+            Move book_move = openingBook.find(level[i].pfen, depth);
+            filter_stats_t *local_stats =
+                collect_stats ? &filter_stats[thread_id] : nullptr;
+            allowed.clear();
+            others.clear();
+            if (depth < max_depth)
+              spawn_children(board, level[i].pfen, level[i].idx, legal_moves,
+                             book_move, allowed, others, local_stats);
+            else // all the children are left to connect_children()
+              this->template spawn_children_as<0>(
+                  board, level[i].pfen, level[i].idx, legal_moves,
+                  Move::NO_MOVE, others, others, nullptr);
+            send(children, allowed);
+            send(other_children, others);
+          }
+        });
+    std::vector<std::vector<child_t>> outbox(shards);
+    for (std::size_t t = 0; t < pool.size(); ++t) {
+      mates.insert(mates.end(), local_mates[t].begin(), local_mates[t].end());
+      for (int s = 0; s < shards; ++s) {
+        outbox[s].insert(outbox[s].end(), children[t][s].begin(),
+                         children[t][s].end());
+        candidates[s].insert(candidates[s].end(), other_children[t][s].begin(),
+                             other_children[t][s].end());
+      }
+    }
+    auto inbox = exchange.exchange("tree" + std::to_string(depth), outbox);
+    std::vector<edge_t> level_edges; // {child, global index of the parent}
+    next_level.clear();
+    for (const auto &[pfen, parent] : inbox) {
+      // most of the inbox are transpositions, so fen2index only grows when
+      // it is full
+      if (!fen2index.room())
+        fen2index.reserve(fen2index.size() + 1);
+      auto [idx, is_new_entry] =
+          fen2index.insert(position_key<Key>(pfen), [&]() { return count++; });
+      level_edges.emplace_back(idx, parent);
+      if (is_new_entry)
+        next_level.push_back({pfen, idx});
+    }
+    edges.push_back(std::move(level_edges));
+    if (collect_stats)
+      details.count_depth(depth + 1, next_level.size(),
+                          inbox.size() - next_level.size());
+    if (count * shards >= NO_INDEX) {
+      out << "Too many positions for " << shards << " shards." << std::endl;
+      std::exit(1);
+    }
+    std::swap(level, next_level);
+    if (exchange.sum("level" + std::to_string(depth), level.size()) == 0)
+      break;
+    out << "Progress: " << count << " (d" << depth + 1 << ")\r" << std::flush;
+  }
+  for (const auto &local_stats : filter_stats)
+    details.filters += local_stats;
+  tb.scores.assign(count, 0);
+  for (index_t idx : mates)
+    tb.scores[idx] = -VALUE_MATE;
+  std::size_t total = exchange.sum("positions", count);
+  auto toc = std::chrono::high_resolution_clock::now();
+  stats_.positions = count;
+  stats_.tree_seconds = std::chrono::duration<double>(toc - tic).count();
+  out << "Found " << count << " of the " << total << " positions to depth "
+      << depth << " in " << std::fixed << std::setprecision(2)
+      << stats_.tree_seconds << "s" << std::endl;
+}
+
+template <typename Key> void ShardedMateTB<Key>::connect_children() {
+  auto tic = std::chrono::high_resolution_clock::now();
+  out << "Connect child nodes ..." << std::endl;
+  auto inbox = exchange.exchange("candidates", candidates);
+  candidates.clear();
+  std::vector<edge_t> candidate_edges;
+  for (const auto &[pfen, parent] : inbox) {
+    index_t idx = fen2index.find_index(position_key<Key>(pfen));
+    if (idx != NO_INDEX)
+      candidate_edges.emplace_back(idx, parent);
+  }
+  edges.push_back(std::move(candidate_edges));
+  std::size_t dim = fen2index.size();
+  build_csr(tb.parents, dim, edges);
+  edges.clear();
+  std::vector<std::vector<index_t>> outbox(shards);
+  for (index_t parent : tb.parents.edges)
+    outbox[parent % shards].push_back(parent / shards);
+  child_count.assign(dim, 0);
+  for (index_t idx : exchange.exchange("children", outbox))
+    child_count[idx]++;
+  auto toc = std::chrono::high_resolution_clock::now();
+  stats_.edges = tb.parents.edges.size();
+  stats_.connect_seconds = std::chrono::duration<double>(toc - tic).count();
+  out << "Connected " << dim << " positions in " << std::fixed
+      << std::setprecision(2) << stats_.connect_seconds << "s" << std::endl;
+}
+
+// The plies are global rounds, which go on until no shard has any nodes left
+// in its levels.
+template <typename Key> void ShardedMateTB<Key>::generate_tb_by_levels() {
+  auto tic = std::chrono::high_resolution_clock::now();
+  out << "Generate tablebase ..." << std::endl;
+  std::vector<std::vector<index_t>> levels = scored_levels();
+  int ply = 0;
+  for (;; ++ply) {
+    if (int(levels.size()) <= ply + 1)
+      levels.resize(ply + 2);
+    std::vector<std::vector<index_t>> outbox(shards);
+    for (index_t idx : levels[ply])
+      for (index_t parent : tb.parents[idx])
+        outbox[parent % shards].push_back(parent / shards);
+    stats_.updates += levels[ply].size();
+    if (collect_stats)
+      details.changed.push_back(levels[ply].size());
+    std::vector<index_t>().swap(levels[ply]);
+    bool lost = ply % 2 == 0;
+    for (index_t parent : exchange.exchange("ply" + std::to_string(ply),
+                                            outbox))
+      if (!tb.scores[parent] && (lost || --child_count[parent] == 0)) {
+        tb.scores[parent] = ply_score(ply + 1);
+        levels[ply + 1].push_back(parent);
+      }
+    std::size_t remaining = 0;
+    for (std::size_t p = ply + 1; p < levels.size(); ++p)
+      remaining += levels[p].size();
+    if (exchange.sum("remaining" + std::to_string(ply), remaining) == 0)
+      break;
+    out << "Ply " << ply << "\r" << std::flush;
+  }
+  auto toc = std::chrono::high_resolution_clock::now();
+  stats_.iterations = ply + 1;
+  stats_.generate_seconds = std::chrono::duration<double>(toc - tic).count();
+  out << "Tablebase generated with " << ply + 1 << " plies in " << std::fixed
+      << std::setprecision(2) << stats_.generate_seconds << "s" << std::endl;
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include "matetb.hpp"
+
+// numbers the spill files of all the SpillBuffers of the process
+inline std::atomic<int> spill_file_count = 0;
+
+// A list of children (or nodes) that is kept in memory up to max_entries
+// entries, and beyond that is spilled to run files sorted by pfen. Reading it
+// back merges the runs in chunks of at most max_entries entries, so that
+// transpositions arrive next to each other and memory stays bounded. With
+// max_entries == 0 it never spills, and it is read back as a single chunk
+// without copying.
+template <typename T> class SpillBuffer {
+public:
+  SpillBuffer(const std::string &dir = "", std::size_t max_entries = 0)
+      : dir_(dir), max_entries_(max_entries) {}
+  SpillBuffer(SpillBuffer &&other) { *this = std::move(other); }
+  SpillBuffer &operator=(SpillBuffer &&other) {
+    std::swap(dir_, other.dir_);
+    std::swap(max_entries_, other.max_entries_);
+    std::swap(size_, other.size_);
+    std::swap(buffer_, other.buffer_);
+    std::swap(runs_, other.runs_);
+    std::swap(readers_, other.readers_);
+    std::swap(heap_, other.heap_);
+    std::swap(reading_, other.reading_);
+    return *this;
+  }
+  ~SpillBuffer() {
+    readers_.clear();
+    for (const auto &run : runs_)
+      std::filesystem::remove(run);
+  }
+
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  bool spilled() const { return !runs_.empty(); }
+
+  // not thread-safe: concurrent callers need to hold a lock
+  void append(const std::vector<T> &entries) {
+    buffer_.insert(buffer_.end(), entries.begin(), entries.end());
+    size_ += entries.size();
+    if (max_entries_ && buffer_.size() >= max_entries_)
+      spill();
+  }
+
+  // as append(), but takes over the memory of entries while nothing is
+  // buffered, and leaves entries empty
+  void append(std::vector<T> &&entries) {
+    if (!buffer_.empty()) {
+      append(entries);
+      entries.clear();
+      return;
+    }
+    size_ += entries.size();
+    buffer_ = std::exchange(entries, {});
+    if (max_entries_ && buffer_.size() >= max_entries_)
+      spill();
+  }
+
+  // moves the next chunk into chunk, returns false once all have been read
+  bool read(std::vector<T> &chunk) {
+    chunk.clear();
+    if (runs_.empty()) {
+      if (reading_)
+        return false;
+      reading_ = true;
+      // the memory of chunk is released rather than kept in the buffer
+      chunk = std::exchange(buffer_, {});
+      return !chunk.empty();
+    }
+    if (!reading_) {
+      reading_ = true;
+      if (!buffer_.empty())
+        spill();
+      for (std::size_t i = 0; i < runs_.size(); ++i) {
+        readers_.push_back(std::make_unique<RunReader>(runs_[i]));
+        push_next(i);
+      }
+    }
+    while (!heap_.empty() && chunk.size() < max_entries_) {
+      std::size_t i = heap_.top().second;
+      chunk.push_back(heap_.top().first);
+      heap_.pop();
+      push_next(i);
+    }
+    return !chunk.empty();
+  }
+
+private:
+  static constexpr std::size_t BLOCK_ENTRIES = 1 << 16;
+
+  // buffered sequential reads of one run file
+  struct RunReader {
+    std::ifstream f;
+    std::vector<T> block;
+    std::size_t pos = 0;
+
+    RunReader(const std::string &filename) : f(filename, std::ios::binary) {}
+    bool next(T &entry) {
+      if (pos == block.size()) {
+        block.resize(BLOCK_ENTRIES);
+        f.read(reinterpret_cast<char *>(block.data()),
+               BLOCK_ENTRIES * sizeof(T));
+        block.resize(f.gcount() / sizeof(T));
+        pos = 0;
+        if (block.empty())
+          return false;
+      }
+      entry = block[pos++];
+      return true;
+    }
+  };
+
+  struct greater_pfen {
+    bool operator()(const std::pair<T, std::size_t> &a,
+                    const std::pair<T, std::size_t> &b) const {
+      return a.first.pfen > b.first.pfen;
+    }
+  };
+
+  void push_next(std::size_t i) {
+    T entry;
+    if (readers_[i]->next(entry))
+      heap_.push({entry, i});
+  }
+
+  // writes the buffer sorted by pfen to a new run file
+  void spill() {
+    std::sort(buffer_.begin(), buffer_.end(),
+              [](const T &a, const T &b) { return a.pfen < b.pfen; });
+    std::string filename = (std::filesystem::path(dir_) /
+                            ("matetb_spill_" + std::to_string(getpid()) + "_" +
+                             std::to_string(spill_file_count++) + ".bin"))
+                               .string();
+    std::ofstream f(filename, std::ios::binary);
+    f.write(reinterpret_cast<const char *>(buffer_.data()),
+            buffer_.size() * sizeof(T));
+    if (!f) {
+      std::cout << "Error writing spill file " << filename << "." << std::endl;
+      std::exit(1);
+    }
+    runs_.push_back(filename);
+    buffer_.clear();
+  }
+
+  std::string dir_;
+  std::size_t max_entries_ = 0, size_ = 0;
+  std::vector<T> buffer_;
+  std::vector<std::string> runs_;
+  std::vector<std::unique_ptr<RunReader>> readers_;
+  std::priority_queue<std::pair<T, std::size_t>,
+                      std::vector<std::pair<T, std::size_t>>,
+                      greater_pfen>
+      heap_;
+  bool reading_ = false;
+};
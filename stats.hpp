@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "external/parallel_hashmap/meminfo.h"
+#include "misc.hpp"
+
+// the reasons for allowed_move() to reject a move, in the order of its checks
+enum filter_t {
+  FILTER_EXCLUDE_MOVES,
+  FILTER_EXCLUDE_SANS,
+  FILTER_RESTRICT_TO,
+  FILTER_EXCLUDE_FROM,
+  FILTER_EXCLUDE_TO,
+  FILTER_EXCLUDE_CAPTURES,
+  FILTER_EXCLUDE_CAPTURES_OF,
+  FILTER_EXCLUDE_TO_ATTACKED,
+  FILTER_EXCLUDE_PROMOTION_TO,
+  FILTER_EXCLUDE_TO_CAPTURABLE,
+  FILTER_EXCLUDE_ALLOWING_CAPTURE,
+  FILTER_EXCLUDE_ALLOWING_FROM,
+  FILTER_EXCLUDE_ALLOWING_TO,
+  FILTER_EXCLUDE_ALLOWING_MOVES,
+  FILTER_EXCLUDE_ALLOWING_SANS,
+  FILTER_COUNT
+};
+
+constexpr std::array<const char *, FILTER_COUNT> filter_names = {
+    "excludeMoves",         "excludeSANs",
+    "restrictTo",           "excludeFrom",
+    "excludeTo",            "excludeCaptures",
+    "excludeCapturesOf",    "excludeToAttacked",
+    "excludePromotionTo",   "excludeToCapturable",
+    "excludeAllowingCapture", "excludeAllowingFrom",
+    "excludeAllowingTo",    "excludeAllowingMoves",
+    "excludeAllowingSANs"};
+
+// the counters of allowed_move() for the moves of the mating side, one per
+// thread (on its own cache line) so that the threads do not share them
+struct alignas(64) filter_stats_t {
+  std::size_t checked = 0, replies = 0; // moves, and moves with replies made
+  std::int64_t reply_ns = 0;            // time spent on the replies
+  std::array<std::size_t, FILTER_COUNT> rejected{};
+
+  filter_stats_t &operator+=(const filter_stats_t &other) {
+    checked += other.checked;
+    replies += other.replies;
+    reply_ns += other.reply_ns;
+    for (int i = 0; i < FILTER_COUNT; ++i)
+      rejected[i] += other.rejected[i];
+    return *this;
+  }
+};
+
+// the new positions at a depth of the BFS, and the children that reached
+// positions already in the tree
+struct depth_stats_t {
+  std::size_t positions = 0, duplicates = 0;
+};
+
+// the load factor of fen2index, and the slots (or keys) compared by the
+// lookups of its keys
+struct map_stats_t {
+  double load_factor = 0, mean_probe = 0;
+  std::size_t max_probe = 0;
+};
+
+// the size of the process (from meminfo.h) and its peak RSS so far, after a
+// phase of create_tb()
+struct memory_stats_t {
+  std::string phase;
+  std::uint64_t used = 0, peak_rss = 0;
+
+  static memory_stats_t after(const std::string &phase) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return {phase, spp::GetProcessMemoryUsed(),
+            std::uint64_t(usage.ru_maxrss) * 1024}; // ru_maxrss is in KB
+  }
+};
+
+// The statistics of --stats. They are aggregated at the end of each phase,
+// and the hot loops only touch the counters of their own thread.
+struct detailed_stats_t {
+  filter_stats_t filters;
+  std::vector<depth_stats_t> depths;
+  map_stats_t map;
+  std::vector<std::size_t> changed; // per iteration (or ply) of the solve
+  std::vector<memory_stats_t> memory;
+
+  void count_depth(int depth, std::size_t positions, std::size_t duplicates) {
+    if (int(depths.size()) <= depth)
+      depths.resize(depth + 1);
+    depths[depth].positions += positions;
+    depths[depth].duplicates += duplicates;
+  }
+
+  void print(std::ostream &os, const std::string &solver) const {
+    auto percent = [](std::size_t part, std::size_t total) {
+      return total ? 100.0 * part / total : 0.0;
+    };
+    os << std::fixed << std::setprecision(1);
+    os << "\nStatistics:\n";
+    os << "Moves of the mating side checked by the excludes: "
+       << filters.checked << "\n";
+    for (int i = 0; i < FILTER_COUNT; ++i)
+      if (filters.rejected[i])
+        os << "  rejected by --" << std::left << std::setw(24)
+           << filter_names[i] << std::right << std::setw(12)
+           << filters.rejected[i] << " ("
+           << percent(filters.rejected[i], filters.checked) << "%)\n";
+    if (filters.replies)
+      os << "  replies made for " << filters.replies << " moves in "
+         << std::setprecision(2) << filters.reply_ns / 1e9 << "s\n"
+         << std::setprecision(1);
+    os << "Depth   positions  duplicates  duplicate rate\n";
+    for (std::size_t d = 0; d < depths.size(); ++d)
+      os << std::setw(5) << d << std::setw(12) << depths[d].positions
+         << std::setw(12) << depths[d].duplicates << std::setw(15)
+         << percent(depths[d].duplicates,
+                    depths[d].positions + depths[d].duplicates)
+         << "%\n";
+    os << std::setprecision(2) << "fen2index: load factor " << map.load_factor
+       << ", mean probe length " << map.mean_probe << ", max probe length "
+       << map.max_probe << "\n";
+    os << "Changed scores per " << (solver == "levels" ? "ply" : "iteration")
+       << ":";
+    for (std::size_t n : changed)
+      os << " " << n;
+    os << "\n";
+    os << "Phase         memory used MB  peak RSS MB\n";
+    for (const auto &m : memory)
+      os << std::left << std::setw(10) << m.phase << std::right
+         << std::setw(18) << m.used / double(1 << 20) << std::setw(13)
+         << m.peak_rss / double(1 << 20) << "\n";
+    os << std::flush;
+  }
+};
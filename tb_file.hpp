@@ -0,0 +1,187 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "misc.hpp"
+
+// The binary TB format: a tb_header_t, the EPD of the root position and the
+// options used for the generation (padded to a multiple of 8 bytes), the
+// sorted keys of all the positions and then their scores, in the same order.
+// If all the mates fit, the scores are stored as compact scores of one byte.
+// With symmetries, the keys are those of the canonical positions.
+struct tb_header_t {
+  char magic[8] = {'M', 'A', 'T', 'E', 'T', 'B', '\0', '\0'};
+  std::uint32_t version = 2;
+  std::uint32_t key_size = 0; // 24 for packed boards, 8 for Zobrist keys
+  std::uint64_t size = 0;     // number of positions
+  std::uint64_t epd_length = 0, options_length = 0;
+  std::uint32_t score_size = 2; // 1 for compact scores, 2 for score_t
+  std::uint32_t symmetries = 0; // the mask of Symmetries for the keys
+};
+
+inline std::uint64_t padded_length(std::uint64_t length) {
+  return (length + 7) / 8 * 8;
+}
+
+// writes a TB with one large write for each array
+template <typename Key>
+void write_tb_file(const std::string &filename, const std::string &epd,
+                   const std::string &options, unsigned symmetries,
+                   std::span<const Key> keys, std::span<const score_t> scores) {
+  std::ofstream f(filename, std::ios::binary);
+  tb_header_t header;
+  header.key_size = sizeof(Key);
+  header.symmetries = symmetries;
+  header.size = keys.size();
+  std::vector<std::uint8_t> compact;
+  if (std::all_of(scores.begin(), scores.end(), [](score_t score) {
+        return !score || mate_ply(score) <= max_compact_ply<std::uint8_t>();
+      })) {
+    header.score_size = 1;
+    compact.reserve(scores.size());
+    for (score_t score : scores)
+      compact.push_back(compact_score<std::uint8_t>(score));
+  }
+  header.epd_length = epd.size();
+  header.options_length = options.size();
+  std::string strings = epd + options;
+  strings.resize(padded_length(strings.size()), '\0');
+  f.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  f.write(strings.data(), strings.size());
+  f.write(reinterpret_cast<const char *>(keys.data()), keys.size_bytes());
+  if (header.score_size == 1)
+    f.write(reinterpret_cast<const char *>(compact.data()), compact.size());
+  else
+    f.write(reinterpret_cast<const char *>(scores.data()),
+            scores.size_bytes());
+  if (!f) {
+    std::cout << "Error writing TB to " << filename << "." << std::endl;
+    std::exit(1);
+  }
+}
+
+// A TB file mapped into memory, so that it can be probed without loading it.
+class TbFile {
+public:
+  TbFile(const std::string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      std::cout << "Cannot open TB file " << filename << "." << std::endl;
+      std::exit(1);
+    }
+    length_ = st.st_size;
+    if (length_ >= sizeof(tb_header_t))
+      data_ = mmap(nullptr, length_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data_ == MAP_FAILED) {
+      std::cout << "Cannot map TB file " << filename << "." << std::endl;
+      std::exit(1);
+    }
+    if (data_)
+      std::memcpy(&header_, data_, sizeof(header_));
+    const tb_header_t expected;
+    std::uint64_t strings_length =
+        padded_length(header_.epd_length + header_.options_length);
+    if (!data_ ||
+        std::memcmp(header_.magic, expected.magic, sizeof(expected.magic)) ||
+        header_.version != expected.version ||
+        (header_.key_size != 24 && header_.key_size != 8) ||
+        (header_.score_size != 1 && header_.score_size != sizeof(score_t)) ||
+        length_ != sizeof(tb_header_t) + strings_length +
+                       header_.size * (header_.key_size + header_.score_size)) {
+      std::cout << "File " << filename << " is not a valid TB file."
+                << std::endl;
+      std::exit(1);
+    }
+    strings_ = static_cast<const char *>(data_) + sizeof(tb_header_t);
+    keys_ = strings_ + strings_length;
+    scores_ = keys_ + header_.size * header_.key_size;
+  }
+
+  ~TbFile() {
+    if (data_)
+      munmap(data_, length_);
+  }
+
+  TbFile(const TbFile &) = delete;
+  TbFile &operator=(const TbFile &) = delete;
+
+  std::size_t size() const { return header_.size; }
+  std::string key_mode() const {
+    return header_.key_size == 24 ? "packed" : "zobrist";
+  }
+  std::string epd() const { return {strings_, header_.epd_length}; }
+  std::string options() const {
+    return {strings_ + header_.epd_length, header_.options_length};
+  }
+  unsigned symmetries() const { return header_.symmetries; }
+
+  template <typename Key> std::span<const Key> keys() const {
+    return {reinterpret_cast<const Key *>(keys_), size()};
+  }
+  score_t score(std::size_t idx) const {
+    if (header_.score_size == 1)
+      return expand_score(reinterpret_cast<const std::uint8_t *>(scores_)[idx]);
+    score_t score;
+    std::memcpy(&score, scores_ + idx * sizeof(score_t), sizeof(score_t));
+    return score;
+  }
+
+  // the position of key in the file, or NO_INDEX
+  template <typename Key> index_t find_index(const Key &key) const {
+    auto keys = this->keys<Key>();
+    auto it = std::lower_bound(keys.begin(), keys.end(), key);
+    return it != keys.end() && *it == key ? index_t(it - keys.begin())
+                                          : NO_INDEX;
+  }
+
+private:
+  void *data_ = nullptr;
+  std::size_t length_ = 0;
+  tb_header_t header_;
+  const char *strings_ = nullptr, *keys_ = nullptr, *scores_ = nullptr;
+};
+
+// merges the TB files of disjoint sets of positions (the shards of a TB) into
+// one TB file, with the EPD, the options and the symmetries of the first one
+template <typename Key>
+void merge_tb_files(const std::vector<std::string> &inputs,
+                    const std::string &output) {
+  std::vector<std::pair<Key, score_t>> entries;
+  std::string epd, options;
+  unsigned symmetries = 0;
+  for (const auto &input : inputs) {
+    TbFile file(input);
+    if (epd.empty()) {
+      epd = file.epd();
+      options = file.options();
+      symmetries = file.symmetries();
+    }
+    auto keys = file.keys<Key>();
+    for (std::size_t idx = 0; idx < keys.size(); ++idx)
+      entries.emplace_back(keys[idx], file.score(idx));
+  }
+  std::sort(entries.begin(), entries.end());
+  std::vector<Key> keys;
+  std::vector<score_t> scores;
+  keys.reserve(entries.size());
+  scores.reserve(entries.size());
+  for (const auto &[key, score] : entries) {
+    keys.push_back(key);
+    scores.push_back(score);
+  }
+  write_tb_file<Key>(output, epd, options, symmetries, keys, scores);
+}